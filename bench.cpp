@@ -0,0 +1,294 @@
+// bench.cpp
+
+// Micro-benchmarks for the kernels of dedup: fingerprint hashing, FASTQ
+// parsing, Bloom and cuckoo filter operations and exact backend inserts. Each one is
+// timed in isolation and reported in ns/op and operations per second.
+
+// Usage: dedup_bench [name filter]   (e.g. dedup_bench bloom)
+
+
+
+#define DEDUP_NO_MAIN
+#include "dedup.cpp"
+
+#include <random>
+
+// --------------------------------------------------
+// Harness
+// --------------------------------------------------
+// A benchmark runs f(n) for n operations, doubling n until a run takes
+// at least MIN_SECONDS; the last run is reported.
+const double MIN_SECONDS = 0.3;
+std::string bench_filter;
+volatile uint64_t bench_sink;  // keeps results alive
+
+void report(const std::string& name, uint64_t n, double sec) {
+    std::cout << std::left << std::setw(44) << name << std::right
+              << std::setw(12) << n
+              << std::fixed << std::setprecision(1) << std::setw(12) << (sec * 1e9 / n)
+              << std::setprecision(2) << std::setw(12) << (n / sec / 1e6) << std::endl;
+}
+
+template <typename F>
+void bench(const std::string& name, F f) {
+    if (name.find(bench_filter) == std::string::npos) return;
+    uint64_t n = 1024;
+    double sec = 0;
+    while (true) {
+        auto start = std::chrono::steady_clock::now();
+        bench_sink = f(n);
+        sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (sec >= MIN_SECONDS) break;
+        n *= 2;
+    }
+    report(name, n, sec);
+}
+
+// For benchmarks with an expensive setup: f() does n operations once
+template <typename F>
+void bench_once(const std::string& name, uint64_t n, F f) {
+    if (name.find(bench_filter) == std::string::npos) return;
+    auto start = std::chrono::steady_clock::now();
+    bench_sink = f();
+    report(name, n, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
+
+uint64_t splitmix64(uint64_t& state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+std::vector<Fingerprint> random_keys(size_t n, uint64_t seed) {
+    std::vector<Fingerprint> keys(n);
+    for (Fingerprint& k : keys) {
+        k.hi = splitmix64(seed);
+        k.lo = splitmix64(seed);
+    }
+    return keys;
+}
+
+std::string random_bases(size_t n, std::mt19937_64& rng) {
+    static const char bases[] = "ACGT";
+    std::string s(n, 'A');
+    for (char& c : s) c = bases[rng() & 3];
+    return s;
+}
+
+// --------------------------------------------------
+// Fingerprints
+// --------------------------------------------------
+// Alternatives to the SHA-256 key, on the bytes of a 2 x 150 bp pair
+uint64_t fnv1a64(const std::string& s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : s) h = (h ^ c) * 0x100000001b3ULL;
+    return h;
+}
+
+void bench_fingerprints() {
+    std::mt19937_64 rng(1);
+    std::vector<std::string> keys(1024);
+    for (std::string& k : keys) k = random_bases(150, rng) + "\n" + random_bases(150, rng) + "\n";
+
+    bench("fingerprint sha256 (302 B)", [&](uint64_t n) {
+        uint64_t x = 0;
+        for (uint64_t i = 0; i < n; i++) x += fingerprint(keys[i & 1023]).lo;
+        return x;
+    });
+    bench("fingerprint sha1 (302 B)", [&](uint64_t n) {
+        uint64_t x = 0;
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        for (uint64_t i = 0; i < n; i++) {
+            const std::string& k = keys[i & 1023];
+            SHA1(reinterpret_cast<const unsigned char*>(k.data()), k.size(), digest);
+            x += digest[0];
+        }
+        return x;
+    });
+    bench("fingerprint std::hash (302 B)", [&](uint64_t n) {
+        uint64_t x = 0;
+        std::hash<std::string> h;
+        for (uint64_t i = 0; i < n; i++) x += h(keys[i & 1023]);
+        return x;
+    });
+    bench("fingerprint fnv1a64 (302 B)", [&](uint64_t n) {
+        uint64_t x = 0;
+        for (uint64_t i = 0; i < n; i++) x += fnv1a64(keys[i & 1023]);
+        return x;
+    });
+}
+
+// --------------------------------------------------
+// FASTQ parsing
+// --------------------------------------------------
+// read_fastq_record() on a plain file (parsing only, zlib passes it
+// through) and on a gzip file (inflate + parsing)
+void bench_parsing() {
+    const size_t records = 200000;
+    std::mt19937_64 rng(2);
+    std::string plain = "dedup_bench." + std::to_string(getpid()) + ".fq";
+    std::string gz = plain + ".gz";
+    for (const std::string& file : {plain, gz}) {
+        gzFile out = gzopen(file.c_str(), file == plain ? "wT" : "wb6");
+        for (size_t i = 0; i < records; i++) {
+            FastqRecord r{"@bench:" + std::to_string(i) + ":ACGTACGT 1:N:0\n", random_bases(150, rng) + "\n", "+\n",
+                          std::string(150, 'F') + "\n"};
+            write_fastq_record(out, r);
+        }
+        gzclose(out);
+    }
+    for (const std::string& file : {plain, gz}) {
+        bench_once(std::string("read_fastq_record ") + (file == plain ? "plain" : "gzip") + " (150 bp)", records, [&] {
+            gzFile in = gzopen(file.c_str(), "rb");
+            FastqRecord r;
+            uint64_t n = 0;
+            while (read_fastq_record(in, r)) n += r.seq.size();
+            gzclose(in);
+            return n;
+        });
+        std::remove(file.c_str());
+    }
+}
+
+// --------------------------------------------------
+// Bloom filter
+// --------------------------------------------------
+void bench_bloom() {
+    const size_t n_keys = 1 << 20;
+    std::vector<Fingerprint> keys = random_keys(n_keys, 3), others = random_keys(n_keys, 4);
+    for (uint64_t bits : {uint64_t(1) << 23, uint64_t(1) << 27, uint64_t(1) << 31}) {
+        for (unsigned k : {3u, 7u, 10u}) {
+            bloom_parameters params;
+            params.projected_element_count = n_keys;
+            params.false_positive_probability = 0.001;
+            params.compute_optimal_parameters();
+            params.optimal_parameters.table_size = bits;
+            params.optimal_parameters.number_of_hashes = k;
+            bloom_filter filter(params);
+            std::string tag = " (" + std::to_string(bits >> 23) + " MB, k=" + std::to_string(k) + ")";
+            bench("bloom insert" + tag, [&](uint64_t n) {
+                for (uint64_t i = 0; i < n; i++) filter.insert(keys[i & (n_keys - 1)]);
+                return filter.element_count();
+            });
+            bench("bloom contains, present" + tag, [&](uint64_t n) {
+                uint64_t x = 0;
+                for (uint64_t i = 0; i < n; i++) x += filter.contains(keys[i & (n_keys - 1)]);
+                return x;
+            });
+            bench("bloom contains, absent" + tag, [&](uint64_t n) {
+                uint64_t x = 0;
+                for (uint64_t i = 0; i < n; i++) x += filter.contains(others[i & (n_keys - 1)]);
+                return x;
+            });
+        }
+    }
+}
+
+// --------------------------------------------------
+// Cuckoo filter
+// --------------------------------------------------
+// Filters sized as by --use-cuckoo for the key count; the inserts fill
+// the filter, so they run once, and the lookups use the filled filter
+void bench_cuckoo() {
+    std::vector<Fingerprint> others = random_keys(1 << 20, 9);
+    for (size_t n_keys : {size_t(1) << 20, size_t(20000000)}) {
+        std::vector<Fingerprint> keys = random_keys(n_keys, 8);
+        CuckooFilter filter(n_keys);
+        std::string tag = " (" + std::to_string(n_keys / 1000000) + "M keys, " +
+                          std::to_string(filter.memory_bytes() >> 20) + " MB)";
+        bench_once("cuckoo insert" + tag, n_keys, [&] {
+            uint64_t x = 0;
+            for (const Fingerprint& k : keys) x += filter.insert(k.hi, k.lo);
+            return x;
+        });
+        if (filter.size() == 0)
+            for (const Fingerprint& k : keys) filter.insert(k.hi, k.lo);
+        bench("cuckoo contains, present" + tag, [&](uint64_t n) {
+            uint64_t x = 0;
+            size_t j = 0;
+            for (uint64_t i = 0; i < n; i++) {
+                x += filter.contains(keys[j].hi, keys[j].lo);
+                if (++j == n_keys) j = 0;
+            }
+            return x;
+        });
+        bench("cuckoo contains, absent" + tag, [&](uint64_t n) {
+            uint64_t x = 0;
+            for (uint64_t i = 0; i < n; i++) {
+                const Fingerprint& k = others[i & ((1 << 20) - 1)];
+                x += filter.contains(k.hi, k.lo);
+            }
+            return x;
+        });
+    }
+}
+
+// --------------------------------------------------
+// CPU-specific kernels
+// --------------------------------------------------
+// Each version the CPU supports, scanning a 16 MB array (as for the
+// Bloom filter fill ratio); one operation is 1 KB, so Mops/s ~ GB/s
+void bench_kernels() {
+    std::vector<Fingerprint> words = random_keys(1 << 20, 7);
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(words.data());
+    const size_t size = words.size() * sizeof(Fingerprint);
+    std::vector<std::pair<SimdLevel, size_t (*)(const unsigned char*, size_t)>> kernels = {
+        {SIMD_GENERIC, popcount_bytes_generic}};
+#ifdef DEDUP_X86_KERNELS
+    kernels.push_back({SIMD_AVX2, popcount_bytes_avx2});
+    kernels.push_back({SIMD_AVX512, popcount_bytes_avx512});
+#endif
+    for (auto& k : kernels) {
+        if (k.first > simd_level()) continue;
+        bench(std::string("popcount ") + SIMD_NAMES[k.first] + " (1 KB of 16 MB)", [&](uint64_t n) {
+            uint64_t x = 0, left = n * 1024;
+            while (left > 0) {
+                size_t len = std::min<uint64_t>(left, size);
+                x += k.second(bytes, len);
+                left -= len;
+            }
+            return x;
+        });
+    }
+}
+
+// --------------------------------------------------
+// Exact backends
+// --------------------------------------------------
+void bench_backends() {
+    for (size_t n_keys : {size_t(1) << 16, size_t(1) << 20, size_t(1) << 23}) {
+        std::vector<Fingerprint> keys = random_keys(n_keys, 5);
+        bench_once("memory set insert (" + std::to_string(n_keys) + " keys)", n_keys, [&] {
+            MemoryStore store;
+            uint64_t x = 0;
+            for (const Fingerprint& k : keys) x += store.is_unique(k);
+            return x;
+        });
+    }
+    for (size_t n_keys : {size_t(1) << 16, size_t(1) << 20}) {
+        std::vector<Fingerprint> keys = random_keys(n_keys, 6);
+        std::string file = "dedup_bench." + std::to_string(getpid()) + ".sqlite";
+        bench_once("sqlite insert (" + std::to_string(n_keys) + " keys)", n_keys, [&] {
+            SQLiteStore* store = new SQLiteStore(file);
+            uint64_t x = 0;
+            for (const Fingerprint& k : keys) x += store->is_unique(k);
+            delete store;
+            return x;
+        });
+        for (const char* suffix : {"", "-wal", "-shm"}) std::remove((file + suffix).c_str());
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1) bench_filter = argv[1];
+    std::cout << std::left << std::setw(44) << "benchmark" << std::right << std::setw(12) << "ops"
+              << std::setw(12) << "ns/op" << std::setw(12) << "Mops/s" << "\n";
+    bench_fingerprints();
+    bench_parsing();
+    bench_bloom();
+    bench_cuckoo();
+    bench_kernels();
+    bench_backends();
+    return 0;
+}
@@ -0,0 +1,135 @@
+// cuckoo_filter.hpp
+
+// Cuckoo filter (Fan et al., "Cuckoo filter: practically better than
+// Bloom", CoNEXT 2014) with buckets of four 16-bit tags.
+
+// A key is a 16-bit tag stored in one of two buckets, i1 from the hash
+// and i2 = (h(tag) - i1) mod m, so a lookup reads at most two 8-byte
+// buckets and compares the tag against all eight slots at once (SSE2, or
+// a portable SWAR compare). The subtraction, unlike the usual XOR, maps
+// i2 back to i1 for any bucket count m, so the table is sized for the
+// expected keys instead of being rounded up to a power of two. With
+// 16-bit tags the false positive rate is about 8 / 2^16 = 1.2e-4 at
+// ~18 bits per key (the table is sized for 90% load).
+
+// When an insert fails after MAX_KICKS relocations, the last evicted tag
+// is kept in a one-entry victim slot (still found by lookups) and the
+// filter reports full(): it accepts no more keys, and the caller is
+// expected to continue in a new filter.
+
+#ifndef INCLUDE_CUCKOO_FILTER_HPP
+#define INCLUDE_CUCKOO_FILTER_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+class CuckooFilter {
+public:
+    CuckooFilter(uint64_t expected_keys) {
+        uint64_t buckets = (expected_keys * 100 + SLOTS * LOAD_PERCENT - 1) / (SLOTS * LOAD_PERCENT);
+        table.assign(buckets > 0 ? buckets : 1, 0);
+    }
+
+    // hash gives the bucket, tag_hash the 16-bit tag; both must be
+    // independent hash bits
+    bool contains(uint64_t hash, uint64_t tag_hash) const {
+        uint16_t tag = make_tag(tag_hash);
+        uint64_t i1 = index(hash), i2 = alt_index(i1, tag);
+        if (has_victim && victim_tag == tag && (victim_index == i1 || victim_index == i2)) return true;
+        return match(table[i1], table[i2], tag);
+    }
+
+    // False once the filter is full (the key is still stored)
+    bool insert(uint64_t hash, uint64_t tag_hash) {
+        if (has_victim) return false;
+        uint16_t tag = make_tag(tag_hash);
+        uint64_t i = index(hash);
+        if (put(i, tag) || put(alt_index(i, tag), tag)) {
+            count++;
+            return true;
+        }
+        count++;
+        // Relocate: evict a tag, move it to its other bucket, repeat
+        if (rng & 1) i = alt_index(i, tag);
+        for (unsigned kick = 0; kick < MAX_KICKS; kick++) {
+            rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+            unsigned slot = (rng >> 33) % SLOTS;
+            uint16_t evicted = get(i, slot);
+            set(i, slot, tag);
+            tag = evicted;
+            i = alt_index(i, tag);
+            if (put(i, tag)) return true;
+        }
+        has_victim = true;
+        victim_index = i;
+        victim_tag = tag;
+        return false;
+    }
+
+    bool full() const { return has_victim; }
+    uint64_t size() const { return count; }
+    size_t memory_bytes() const { return table.size() * sizeof(uint64_t); }
+    double load() const { return double(count) / (table.size() * SLOTS); }
+    // Upper bound: 2 buckets x 4 slots, each matching with p = 1 / (2^16 - 1)
+    double fpp() const { return 2.0 * SLOTS * load() / 65535.0; }
+
+private:
+    static const unsigned SLOTS = 4;
+    static const unsigned MAX_KICKS = 500;
+    static const unsigned LOAD_PERCENT = 90;  // expected keys per slot
+
+    std::vector<uint64_t> table;  // bucket = 4 x 16-bit tags, 0 = empty
+    uint64_t count = 0;
+    uint64_t rng = 0x853c49e6748fea9bULL;
+    bool has_victim = false;
+    uint64_t victim_index = 0;
+    uint16_t victim_tag = 0;
+
+    static uint16_t make_tag(uint64_t h) {
+        uint16_t tag = static_cast<uint16_t>(h);
+        return tag ? tag : 1;
+    }
+    // hash mapped to [0, buckets) by a multiply instead of a division
+    uint64_t index(uint64_t hash) const {
+        return static_cast<uint64_t>((static_cast<unsigned __int128>(hash) * table.size()) >> 64);
+    }
+    // (h(tag) - i) mod buckets: alt_index(alt_index(i, tag), tag) == i
+    uint64_t alt_index(uint64_t i, uint16_t tag) const {
+        uint64_t h = index(tag * 0xc6a4a7935bd1e995ULL);
+        return h >= i ? h - i : h + table.size() - i;
+    }
+    uint16_t get(uint64_t b, unsigned slot) const {
+        return static_cast<uint16_t>(table[b] >> (16 * slot));
+    }
+    void set(uint64_t b, unsigned slot, uint16_t tag) {
+        table[b] = (table[b] & ~(0xffffULL << (16 * slot))) | (uint64_t(tag) << (16 * slot));
+    }
+    bool put(uint64_t b, uint16_t tag) {
+        for (unsigned slot = 0; slot < SLOTS; slot++) {
+            if (get(b, slot) == 0) {
+                set(b, slot, tag);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Does tag occur in any of the 8 slots of buckets b1 and b2?
+    static bool match(uint64_t b1, uint64_t b2, uint16_t tag) {
+#ifdef __SSE2__
+        __m128i buckets = _mm_set_epi64x(static_cast<long long>(b2), static_cast<long long>(b1));
+        __m128i eq = _mm_cmpeq_epi16(buckets, _mm_set1_epi16(static_cast<short>(tag)));
+        return _mm_movemask_epi8(eq) != 0;
+#else
+        const uint64_t ones = 0x0001000100010001ULL, highs = 0x8000800080008000ULL;
+        uint64_t x1 = b1 ^ (tag * ones), x2 = b2 ^ (tag * ones);
+        return (((x1 - ones) & ~x1) | ((x2 - ones) & ~x2)) & highs;
+#endif
+    }
+};
+
+#endif
@@ -9,120 +9,2399 @@
 #include <iostream>
 #include <iomanip>  // <<<< this is required for std::setprecision
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
 #include <unordered_set>
+#include <queue>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <atomic>
+#include <cstdlib>
 #include <filesystem>
 #include <zlib.h>
 #include <openssl/sha.h>
 #include <sqlite3.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 #include "bloom_filter.hpp"
+#include "quotient_filter.hpp"
+#include "cuckoo_filter.hpp"
+#include "elias_fano.hpp"
 
 // --------------------------------------------------
-// SHA-256 hashing (hex string)
+// Read fingerprint: first 128 bits of the SHA-256 digest
 // --------------------------------------------------
-std::string sha256(const std::string& data) {
+struct Fingerprint {
+    uint64_t hi, lo;
+    bool operator==(const Fingerprint& o) const { return hi == o.hi && lo == o.lo; }
+    bool operator!=(const Fingerprint& o) const { return !(*this == o); }
+    bool operator<(const Fingerprint& o) const { return hi < o.hi || (hi == o.hi && lo < o.lo); }
+};
+
+struct FingerprintHash {
+    size_t operator()(const Fingerprint& fp) const { return fp.lo; }
+};
+
+// Big-endian bytes, so that memcmp order matches Fingerprint order
+void fingerprint_to_bytes(const Fingerprint& fp, unsigned char out[16]) {
+    for (int i = 0; i < 8; i++) out[i] = static_cast<unsigned char>(fp.hi >> (56 - 8 * i));
+    for (int i = 0; i < 8; i++) out[8 + i] = static_cast<unsigned char>(fp.lo >> (56 - 8 * i));
+}
+
+Fingerprint fingerprint_from_bytes(const unsigned char in[16]) {
+    Fingerprint fp{0, 0};
+    for (int i = 0; i < 8; i++) fp.hi = (fp.hi << 8) | in[i];
+    for (int i = 8; i < 16; i++) fp.lo = (fp.lo << 8) | in[i];
+    return fp;
+}
+
+Fingerprint fingerprint(const std::string& data) {
     unsigned char hash[SHA256_DIGEST_LENGTH];
     SHA256((unsigned char*)data.c_str(), data.size(), hash);
-    std::string hex;
-    char buf[3];
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-        sprintf(buf, "%02x", hash[i]);
-        hex.append(buf);
+    return fingerprint_from_bytes(hash);
+}
+
+// --------------------------------------------------
+// FASTQ record structure
+// --------------------------------------------------
+struct FastqRecord {
+    std::string id, seq, plus, qual;
+};
+
+// --------------------------------------------------
+// Read next FASTQ record
+// --------------------------------------------------
+bool read_fastq_record(gzFile file, FastqRecord &rec) {
+    char buf[10000];
+    if (!gzgets(file, buf, sizeof(buf))) return false;
+    rec.id = buf;
+    if (!gzgets(file, buf, sizeof(buf))) return false;
+    rec.seq = buf;
+    if (!gzgets(file, buf, sizeof(buf))) return false;
+    rec.plus = buf;
+    if (!gzgets(file, buf, sizeof(buf))) return false;
+    rec.qual = buf;
+    return true;
+}
+
+// --------------------------------------------------
+// Write FASTQ record
+// --------------------------------------------------
+void write_fastq_record(gzFile file, const FastqRecord &rec) {
+    gzputs(file, rec.id.c_str());
+    gzputs(file, rec.seq.c_str());
+    gzputs(file, rec.plus.c_str());
+    gzputs(file, rec.qual.c_str());
+}
+
+// --------------------------------------------------
+// Count number of fastq records
+// --------------------------------------------------
+size_t count_fastq_records(const std::string& filename) {
+    gzFile f = gzopen(filename.c_str(), "rb");
+    if (!f) throw std::runtime_error("Cannot open file: " + filename);
+    char buf[8192];
+    size_t lines = 0;
+    while (gzgets(f, buf, sizeof(buf))) ++lines;
+    gzclose(f);
+    return lines / 4;
+}
+
+// --------------------------------------------------
+// Extract barcode from FASTQ header
+// --------------------------------------------------
+std::string extract_barcode_from_name(const std::string& header) {
+    size_t space_pos = header.find(' ');
+    std::string main_part = (space_pos == std::string::npos) ? header : header.substr(0, space_pos);
+    size_t last_colon = main_part.rfind(':');
+    if (last_colon == std::string::npos) return "";
+    return main_part.substr(last_colon + 1);
+}
+
+// --------------------------------------------------
+// Stage profiling (--profile)
+// --------------------------------------------------
+// Every thread doing pipeline work owns a StageProfile and times its
+// stages once per chunk of read pairs, so the clock is read a few times
+// per 4096 pairs. The profiles are printed together at the end of a run.
+enum Stage { STAGE_COUNT, STAGE_READ, STAGE_KEY, STAGE_LOOKUP, STAGE_WRITE, NUM_STAGES };
+const char* const STAGE_NAMES[NUM_STAGES] = {"count", "read", "key", "lookup", "write"};
+
+bool profile_enabled = false;
+
+// With --perf-counters, each thread also counts hardware events (user
+// space only) through perf_event_open. Events that the kernel or CPU does
+// not offer, e.g. in most VMs, stay closed and are reported as missing.
+enum PerfEvent { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_CACHE_MISSES, PERF_DTLB_MISSES,
+                 PERF_BRANCH_MISSES, PERF_PAGE_FAULTS, NUM_PERF_EVENTS };
+const char* const PERF_EVENT_NAMES[NUM_PERF_EVENTS] = {
+    "cycles", "instructions", "cache-misses", "dTLB-load-misses", "branch-misses", "page-faults"};
+
+bool perf_enabled = false;
+
+// With --trace, every timed stage is also kept as an event for a Chrome
+// trace (chrome://tracing, Perfetto), together with samples of queue
+// depths. Stage events go to a per-thread buffer; the rare counter
+// samples share one buffer under a mutex.
+bool trace_enabled = false;
+const std::chrono::steady_clock::time_point trace_origin = std::chrono::steady_clock::now();
+
+struct TraceEvent {
+    Stage stage;
+    uint64_t start_ns, duration_ns;
+};
+
+struct TraceCounter {
+    std::string name;
+    uint64_t time_ns, value;
+};
+
+std::vector<TraceCounter> trace_counters;
+std::mutex trace_counters_mutex;
+
+uint64_t trace_time_ns(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t - trace_origin).count();
+}
+
+void trace_counter(const std::string& name, uint64_t value) {
+    if (!trace_enabled) return;
+    uint64_t now = trace_time_ns(std::chrono::steady_clock::now());
+    std::lock_guard<std::mutex> lock(trace_counters_mutex);
+    trace_counters.push_back({name, now, value});
+}
+
+// Counters of the thread that creates it
+class PerfCounters {
+    int fds[NUM_PERF_EVENTS];
+
+    static int open_event(uint32_t type, uint64_t config) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+public:
+    PerfCounters() {
+        fds[PERF_CYCLES] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        fds[PERF_INSTRUCTIONS] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        fds[PERF_CACHE_MISSES] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        fds[PERF_DTLB_MISSES] = open_event(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                                           (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        fds[PERF_BRANCH_MISSES] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+        fds[PERF_PAGE_FAULTS] = open_event(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+    }
+    ~PerfCounters() {
+        for (int fd : fds)
+            if (fd >= 0) close(fd);
+    }
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool available(int event) const { return fds[event] >= 0; }
+    void read(uint64_t values[NUM_PERF_EVENTS]) const {
+        for (int e = 0; e < NUM_PERF_EVENTS; e++) {
+            values[e] = 0;
+            if (fds[e] >= 0 && ::read(fds[e], &values[e], sizeof(uint64_t)) != sizeof(uint64_t)) values[e] = 0;
+        }
+    }
+};
+
+struct StageProfile {
+    std::string thread;
+    uint64_t ns[NUM_STAGES] = {};
+    uint64_t items[NUM_STAGES] = {};  // read pairs
+    uint64_t bytes[NUM_STAGES] = {};
+    std::unique_ptr<PerfCounters> perf;  // opened by the first timer, in the owning thread
+    uint64_t events[NUM_STAGES][NUM_PERF_EVENTS] = {};
+    std::vector<TraceEvent> trace;
+    uint64_t allocs[NUM_STAGES] = {}, frees[NUM_STAGES] = {}, alloc_bytes[NUM_STAGES] = {};
+
+    void add(Stage stage, uint64_t n, uint64_t b) {
+        items[stage] += n;
+        bytes[stage] += b;
+    }
+};
+
+std::deque<StageProfile> stage_profiles;  // a deque keeps the addresses stable
+std::mutex stage_profiles_mutex;
+
+StageProfile* new_stage_profile(const std::string& thread) {
+    std::lock_guard<std::mutex> lock(stage_profiles_mutex);
+    stage_profiles.emplace_back();
+    stage_profiles.back().thread = thread;
+    return &stage_profiles.back();
+}
+
+// With --alloc-stats, the global operator new and delete count the heap
+// allocations of each thread in the stage it is running (C++ allocations
+// only: zlib and SQLite use malloc directly). The counts go to the
+// thread's own StageProfile, so no atomics are needed in the hot path;
+// allocations outside any stage are counted globally.
+bool alloc_tracking = false;
+thread_local StageProfile* alloc_profile = nullptr;
+thread_local Stage alloc_stage = STAGE_COUNT;
+std::atomic<uint64_t> other_allocs(0), other_frees(0);
+
+inline void count_alloc(size_t size) {
+    if (!alloc_tracking) return;
+    if (alloc_profile) {
+        alloc_profile->allocs[alloc_stage]++;
+        alloc_profile->alloc_bytes[alloc_stage] += size;
+    } else {
+        other_allocs.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+inline void count_free() {
+    if (!alloc_tracking) return;
+    if (alloc_profile) alloc_profile->frees[alloc_stage]++;
+    else other_frees.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Adds the time from construction to destruction to one stage; no clock
+// reads when neither profiling, tracing nor allocation counting is on
+class StageTimer {
+    StageProfile* profile;
+    Stage stage;
+    std::chrono::steady_clock::time_point start;
+    uint64_t start_events[NUM_PERF_EVENTS];
+    StageProfile* outer_profile;
+    Stage outer_stage;
+public:
+    StageTimer(StageProfile* p, Stage s)
+        : profile(profile_enabled || trace_enabled || alloc_tracking ? p : nullptr), stage(s) {
+        if (!profile) return;
+        if (perf_enabled) {
+            if (!profile->perf) profile->perf.reset(new PerfCounters());
+            profile->perf->read(start_events);
+        }
+        outer_profile = alloc_profile;
+        outer_stage = alloc_stage;
+        alloc_profile = profile;
+        alloc_stage = stage;
+        start = std::chrono::steady_clock::now();
+    }
+    ~StageTimer() {
+        if (!profile) return;
+        alloc_profile = outer_profile;
+        alloc_stage = outer_stage;
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        profile->ns[stage] += ns;
+        if (trace_enabled) profile->trace.push_back({stage, trace_time_ns(start), ns});
+        if (perf_enabled) {
+            uint64_t end_events[NUM_PERF_EVENTS];
+            profile->perf->read(end_events);
+            for (int e = 0; e < NUM_PERF_EVENTS; e++)
+                profile->events[stage][e] += end_events[e] - start_events[e];
+        }
+    }
+};
+
+void* operator new(std::size_t size) {
+    count_alloc(size);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept {
+    if (p) count_free();
+    std::free(p);
+}
+void operator delete[](void* p) noexcept { operator delete(p); }
+void operator delete(void* p, std::size_t) noexcept { operator delete(p); }
+void operator delete[](void* p, std::size_t) noexcept { operator delete(p); }
+
+// Allocations in the stages of the main loop (read, key, lookup, write)
+// of all threads
+uint64_t main_loop_allocs() {
+    uint64_t n = 0;
+    for (const StageProfile& p : stage_profiles)
+        for (int s = STAGE_READ; s < NUM_STAGES; s++) n += p.allocs[s];
+    return n;
+}
+
+// The first chunk fills the reused buffers; the count after it is the
+// steady state, which should stay at zero for most backends
+uint64_t warmup_allocs = 0, warmup_pairs = 0;
+
+void mark_alloc_warmup(uint64_t pairs) {
+    warmup_allocs = main_loop_allocs();
+    warmup_pairs = pairs;
+}
+
+double allocs_per_pair(uint64_t pairs) {
+    return pairs ? double(main_loop_allocs()) / pairs : 0.0;
+}
+
+uint64_t steady_allocs() {
+    return main_loop_allocs() - warmup_allocs;
+}
+
+double steady_allocs_per_pair(uint64_t pairs) {
+    return pairs > warmup_pairs ? double(steady_allocs()) / (pairs - warmup_pairs) : 0.0;
+}
+
+void print_alloc_stats(uint64_t pairs) {
+    std::cerr << "\nHeap allocations (operator new):\n";
+    std::cerr << "  thread           stage        allocs       frees        MB  allocs/pair\n";
+    for (const StageProfile& p : stage_profiles) {
+        for (int s = 0; s < NUM_STAGES; s++) {
+            if (p.allocs[s] == 0 && p.frees[s] == 0) continue;
+            std::cerr << "  " << std::left << std::setw(16) << p.thread << " " << std::setw(8) << STAGE_NAMES[s]
+                      << std::right << std::setw(12) << p.allocs[s] << std::setw(12) << p.frees[s]
+                      << std::fixed << std::setprecision(1) << std::setw(10) << p.alloc_bytes[s] / 1e6
+                      << std::setprecision(3) << std::setw(13) << (pairs ? double(p.allocs[s]) / pairs : 0.0) << "\n";
+        }
+    }
+    std::cerr << "  outside stages: " << other_allocs.load() << " allocs, " << other_frees.load() << " frees\n";
+    std::cerr << "  main loop: " << std::setprecision(3) << allocs_per_pair(pairs)
+              << " allocations per read pair, " << steady_allocs_per_pair(pairs)
+              << " after the first chunk\n" << std::setprecision(1);
+}
+
+size_t fastq_record_bytes(const FastqRecord& rec) {
+    return rec.id.size() + rec.seq.size() + rec.plus.size() + rec.qual.size();
+}
+
+// Hardware events per million read pairs of each stage
+void print_perf_counters() {
+    bool any = false;
+    for (const StageProfile& p : stage_profiles)
+        for (int e = 0; e < NUM_PERF_EVENTS; e++) any = any || (p.perf && p.perf->available(e));
+    if (!any) {
+        std::cerr << "\nHardware counters unavailable (perf_event_open failed; "
+                  << "see /proc/sys/kernel/perf_event_paranoid)\n";
+        return;
+    }
+    std::cerr << "\nCounters per million read pairs:\n";
+    std::cerr << "  thread           stage   ";
+    for (int e = 0; e < NUM_PERF_EVENTS; e++) std::cerr << std::setw(17) << PERF_EVENT_NAMES[e];
+    std::cerr << "    IPC\n";
+    for (const StageProfile& p : stage_profiles) {
+        if (!p.perf) continue;
+        for (int s = 0; s < NUM_STAGES; s++) {
+            if (p.ns[s] == 0 || p.items[s] == 0) continue;
+            std::cerr << "  " << std::left << std::setw(16) << p.thread << " " << std::setw(8) << STAGE_NAMES[s]
+                      << std::right << std::scientific << std::setprecision(2);
+            for (int e = 0; e < NUM_PERF_EVENTS; e++) {
+                if (p.perf->available(e)) std::cerr << std::setw(17) << (1e6 * p.events[s][e] / p.items[s]);
+                else std::cerr << std::setw(17) << "-";
+            }
+            std::cerr << std::fixed << std::setprecision(2);
+            if (p.perf->available(PERF_CYCLES) && p.perf->available(PERF_INSTRUCTIONS) && p.events[s][PERF_CYCLES])
+                std::cerr << std::setw(7) << double(p.events[s][PERF_INSTRUCTIONS]) / p.events[s][PERF_CYCLES];
+            else
+                std::cerr << std::setw(7) << "-";
+            std::cerr << "\n";
+        }
+    }
+}
+
+void print_stage_profiles() {
+    std::cerr << "\nProfile:\n";
+    std::cerr << "  thread           stage      time (s)  share   pairs/s      MB/s\n";
+    for (const StageProfile& p : stage_profiles) {
+        uint64_t total = 0;
+        for (int s = 0; s < NUM_STAGES; s++) total += p.ns[s];
+        for (int s = 0; s < NUM_STAGES; s++) {
+            if (p.ns[s] == 0) continue;
+            double sec = p.ns[s] * 1e-9;
+            std::cerr << "  " << std::left << std::setw(16) << p.thread << " " << std::setw(8) << STAGE_NAMES[s]
+                      << std::right << std::fixed << std::setprecision(3) << std::setw(10) << sec
+                      << std::setprecision(1) << std::setw(6) << (100.0 * p.ns[s] / total) << "%"
+                      << std::setprecision(0) << std::setw(10) << (p.items[s] / sec);
+            if (p.bytes[s]) std::cerr << std::setprecision(1) << std::setw(10) << (p.bytes[s] / sec / 1e6);
+            else std::cerr << std::setw(10) << "-";
+            std::cerr << "\n";
+        }
+    }
+    if (perf_enabled) print_perf_counters();
+    std::cerr << std::fixed << std::setprecision(1);
+}
+
+// Chrome trace event format: one complete ("X") event per timed stage,
+// one thread per profile, and counter ("C") events for queue depths
+bool write_trace(const std::string& filename) {
+    std::ofstream out(filename);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"dedup\"}}";
+    out << std::fixed << std::setprecision(3);
+    int tid = 0;
+    for (const StageProfile& p : stage_profiles) {
+        tid++;
+        out << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << tid
+            << ", \"args\": {\"name\": \"" << p.thread << "\"}}";
+        for (const TraceEvent& e : p.trace) {
+            out << ",\n{\"name\": \"" << STAGE_NAMES[e.stage] << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << tid
+                << ", \"ts\": " << e.start_ns / 1e3 << ", \"dur\": " << e.duration_ns / 1e3 << "}";
+        }
+    }
+    for (const TraceCounter& c : trace_counters) {
+        out << ",\n{\"name\": \"" << c.name << "\", \"ph\": \"C\", \"pid\": 1, \"ts\": " << c.time_ns / 1e3
+            << ", \"args\": {\"depth\": " << c.value << "}}";
+    }
+    out << "\n]}\n";
+    return static_cast<bool>(out);
+}
+
+// --------------------------------------------------
+// Backend latency histograms (--latency)
+// --------------------------------------------------
+// One backend operation in LATENCY_SAMPLE_EVERY is timed and added to a
+// log-linear (HDR-style) histogram: values are grouped by power of two,
+// and each group is split into 16 linear buckets, so a bucket is within
+// 1/16 of its values. A separate histogram is kept for each doubling of
+// the number of keys inserted so far, to show when a backend slows down
+// as it grows.
+bool latency_enabled = false;
+const uint64_t LATENCY_SAMPLE_EVERY = 64;
+
+class LatencyHistogram {
+    static const unsigned SUB_BITS = 4;
+    static const unsigned SUB = 1 << SUB_BITS;
+    std::vector<uint64_t> counts = std::vector<uint64_t>((64 - SUB_BITS + 1) * SUB, 0);
+    uint64_t samples = 0, max_value = 0;
+
+    static size_t bucket(uint64_t v) {
+        if (v < SUB) return v;
+        unsigned e = 63 - __builtin_clzll(v);
+        return (e - SUB_BITS + 1) * SUB + ((v >> (e - SUB_BITS)) & (SUB - 1));
+    }
+    // Largest value of a bucket
+    static uint64_t bucket_top(size_t b) {
+        if (b < SUB) return b;
+        unsigned e = b / SUB + SUB_BITS - 1;
+        uint64_t sub = b % SUB;
+        return ((SUB + sub + 1) << (e - SUB_BITS)) - 1;
+    }
+public:
+    void record(uint64_t ns) {
+        counts[bucket(ns)]++;
+        samples++;
+        max_value = std::max(max_value, ns);
+    }
+    uint64_t count() const { return samples; }
+    uint64_t max() const { return max_value; }
+    // Smallest bucket top with at least fraction q of the samples below it
+    uint64_t percentile(double q) const {
+        uint64_t rank = static_cast<uint64_t>(std::ceil(q * samples)), seen = 0;
+        for (size_t b = 0; b < counts.size(); b++) {
+            seen += counts[b];
+            if (seen >= rank && seen > 0) return std::min(bucket_top(b), max_value);
+        }
+        return max_value;
+    }
+};
+
+// Times the backend operations of one thread
+class LatencyRecorder {
+    std::vector<LatencyHistogram> by_keys;  // [k]: 2^(k-1) <= keys inserted < 2^k
+    uint64_t inserted = 0, tick = 0;
+public:
+    std::string name;
+
+    // op() does one backend operation and returns true for a new key
+    template <typename Op>
+    bool time(Op op) {
+        if (!latency_enabled || ++tick % LATENCY_SAMPLE_EVERY != 0) {
+            bool is_new = op();
+            inserted += is_new;
+            return is_new;
+        }
+        size_t k = inserted ? 64 - __builtin_clzll(inserted) : 0;
+        auto start = std::chrono::steady_clock::now();
+        bool is_new = op();
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        if (by_keys.size() <= k) by_keys.resize(k + 1);
+        by_keys[k].record(ns);
+        inserted += is_new;
+        return is_new;
+    }
+
+    size_t ranges() const { return by_keys.size(); }
+    const LatencyHistogram& range(size_t k) const { return by_keys[k]; }
+    static uint64_t range_start(size_t k) { return k ? uint64_t(1) << (k - 1) : 0; }
+};
+
+std::deque<LatencyRecorder> latency_recorders;
+std::mutex latency_recorders_mutex;
+
+LatencyRecorder* new_latency_recorder(const std::string& name) {
+    std::lock_guard<std::mutex> lock(latency_recorders_mutex);
+    latency_recorders.emplace_back();
+    latency_recorders.back().name = name;
+    return &latency_recorders.back();
+}
+
+void print_latency_histograms() {
+    std::cerr << "\nBackend latency in ns (1 in " << LATENCY_SAMPLE_EVERY << " operations timed):\n";
+    std::cerr << "  thread           keys inserted     samples       p50       p99     p99.9       max\n";
+    for (const LatencyRecorder& r : latency_recorders) {
+        for (size_t k = 0; k < r.ranges(); k++) {
+            const LatencyHistogram& h = r.range(k);
+            if (h.count() == 0) continue;
+            std::cerr << "  " << std::left << std::setw(16) << r.name << " " << std::right
+                      << std::setw(6) << LatencyRecorder::range_start(k) << "-" << std::left << std::setw(6)
+                      << (uint64_t(1) << k) - 1 << std::right << std::setw(12) << h.count()
+                      << std::setw(10) << h.percentile(0.5) << std::setw(10) << h.percentile(0.99)
+                      << std::setw(10) << h.percentile(0.999) << std::setw(10) << h.max() << "\n";
+        }
+    }
+}
+
+// --------------------------------------------------
+// Run report (--stats-json)
+// --------------------------------------------------
+// Minimal JSON writer: an object of numbers, strings and nested values
+// written in insertion order
+class JsonObject {
+    std::ostringstream out;
+    bool empty = true;
+
+    std::ostream& key(const std::string& name) {
+        out << (empty ? "{" : ", ") << quote(name) << ": ";
+        empty = false;
+        return out;
+    }
+public:
+    static std::string quote(const std::string& text) {
+        std::ostringstream q;
+        q << '"';
+        for (unsigned char c : text) {
+            if (c == '"' || c == '\\') q << '\\' << c;
+            else if (c < 0x20) q << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec;
+            else q << c;
+        }
+        q << '"';
+        return q.str();
+    }
+
+    JsonObject& add(const std::string& name, uint64_t value) { key(name) << value; return *this; }
+    JsonObject& add(const std::string& name, double value) {
+        if (std::isfinite(value)) key(name) << std::setprecision(6) << value;
+        else key(name) << "null";
+        return *this;
+    }
+    JsonObject& add(const std::string& name, const std::string& value) { key(name) << quote(value); return *this; }
+    JsonObject& add(const std::string& name, const JsonObject& value) { key(name) << value.str(); return *this; }
+    // value must already be JSON
+    JsonObject& add_raw(const std::string& name, const std::string& value) { key(name) << value; return *this; }
+
+    std::string str() const { return empty ? "{}" : out.str() + "}"; }
+};
+
+std::string stage_profiles_json() {
+    std::string list = "[";
+    for (const StageProfile& p : stage_profiles) {
+        for (int s = 0; s < NUM_STAGES; s++) {
+            if (p.ns[s] == 0) continue;
+            double sec = p.ns[s] * 1e-9;
+            JsonObject stage;
+            stage.add("thread", p.thread).add("stage", std::string(STAGE_NAMES[s])).add("seconds", sec)
+                 .add("pairs", p.items[s]).add("bytes", p.bytes[s])
+                 .add("pairs_per_s", p.items[s] / sec).add("mb_per_s", p.bytes[s] / sec / 1e6);
+            if (p.perf) {
+                JsonObject events;
+                for (int e = 0; e < NUM_PERF_EVENTS; e++)
+                    if (p.perf->available(e)) events.add(PERF_EVENT_NAMES[e], p.events[s][e]);
+                stage.add("events", events);
+            }
+            list += (list.size() > 1 ? ", " : "") + stage.str();
+        }
+    }
+    return list + "]";
+}
+
+std::string latency_json() {
+    std::string list = "[";
+    for (const LatencyRecorder& r : latency_recorders) {
+        for (size_t k = 0; k < r.ranges(); k++) {
+            const LatencyHistogram& h = r.range(k);
+            if (h.count() == 0) continue;
+            JsonObject range;
+            range.add("thread", r.name).add("keys_from", LatencyRecorder::range_start(k))
+                 .add("keys_to", (uint64_t(1) << k) - 1).add("samples", h.count())
+                 .add("p50_ns", h.percentile(0.5)).add("p99_ns", h.percentile(0.99))
+                 .add("p999_ns", h.percentile(0.999)).add("max_ns", h.max());
+            list += (list.size() > 1 ? ", " : "") + range.str();
+        }
+    }
+    return list + "]";
+}
+
+// --------------------------------------------------
+// In-memory backend (exact)
+// --------------------------------------------------
+class MemoryStore {
+    std::unordered_set<Fingerprint, FingerprintHash> seen;
+public:
+    bool is_unique(const Fingerprint& fp) { return seen.insert(fp).second; }
+
+    size_t size() const { return seen.size(); }
+    double load_factor() const { return seen.load_factor(); }
+    // Nodes (key, next pointer, cached hash) plus the bucket array
+    size_t memory_bytes() const {
+        return seen.size() * (sizeof(Fingerprint) + 2 * sizeof(void*)) + seen.bucket_count() * sizeof(void*);
+    }
+
+    // Move every stored fingerprint to keys (used to save a snapshot)
+    void dump(std::vector<Fingerprint>& keys) {
+        keys.assign(seen.begin(), seen.end());
+        seen.clear();
+    }
+};
+
+// --------------------------------------------------
+// SQLite backend
+// --------------------------------------------------
+// The database is scratch space: it is emptied when opened, written
+// without fsync and committed in large transactions. Keys are the 16
+// fingerprint bytes in a WITHOUT ROWID table, so the primary key index is
+// the table itself.
+//
+// Optionally a Bloom filter sits in front of the table. Keys it has never
+// seen are new for sure: they skip the B-tree probe and go to a bulk-load
+// buffer that is sorted and inserted in one transaction when full. Only
+// Bloom positives are checked exactly, against the buffer and the table.
+class SQLiteStore {
+    static const size_t TRANSACTION_SIZE = 100000;
+    static const size_t BULK_SIZE = 1 << 18;
+    sqlite3* db;
+    sqlite3_stmt* insert = nullptr;
+    sqlite3_stmt* lookup = nullptr;
+    size_t pending = 0;
+    bloom_filter* bloom = nullptr;
+    std::vector<Fingerprint> bulk;
+    std::unordered_set<Fingerprint, FingerprintHash> bulk_set;
+    size_t probes = 0;
+
+    void exec(const char* sql) {
+        char* err = nullptr;
+        if (sqlite3_exec(db, sql, 0, 0, &err) != SQLITE_OK) {
+            std::string msg = err ? err : "unknown error";
+            sqlite3_free(err);
+            throw std::runtime_error(std::string("SQLite error in \"") + sql + "\": " + msg);
+        }
+    }
+
+    // INSERT OR IGNORE; true if the key was not in the table
+    bool insert_key(const Fingerprint& fp) {
+        unsigned char key[16];
+        fingerprint_to_bytes(fp, key);
+        sqlite3_bind_blob(insert, 1, key, sizeof(key), SQLITE_STATIC);
+        int rc = sqlite3_step(insert);
+        sqlite3_reset(insert);
+        if (rc != SQLITE_DONE)
+            throw std::runtime_error(std::string("SQLite insert failed: ") + sqlite3_errmsg(db));
+        // INSERT OR IGNORE changes no row when the key is already there
+        return sqlite3_changes(db) == 1;
+    }
+
+    bool contains_key(const Fingerprint& fp) {
+        unsigned char key[16];
+        fingerprint_to_bytes(fp, key);
+        sqlite3_bind_blob(lookup, 1, key, sizeof(key), SQLITE_STATIC);
+        int rc = sqlite3_step(lookup);
+        sqlite3_reset(lookup);
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+            throw std::runtime_error(std::string("SQLite lookup failed: ") + sqlite3_errmsg(db));
+        return rc == SQLITE_ROW;
+    }
+
+    void add_to_bulk(const Fingerprint& fp) {
+        bulk.push_back(fp);
+        bulk_set.insert(fp);
+        if (bulk.size() >= BULK_SIZE) flush_bulk();
+    }
+
+    // Insert the buffered keys in key order, so the B-tree is filled
+    // mostly sequentially
+    void flush_bulk() {
+        std::sort(bulk.begin(), bulk.end());
+        for (const Fingerprint& fp : bulk) insert_key(fp);
+        exec("COMMIT; BEGIN;");
+        bulk.clear();
+        bulk_set.clear();
+    }
+public:
+    SQLiteStore(const std::string& filename, uint64_t bloom_keys = 0) {
+        if (sqlite3_open(filename.c_str(), &db))
+            throw std::runtime_error("Cannot open SQLite DB");
+        exec("PRAGMA journal_mode=WAL;");
+        exec("PRAGMA synchronous=OFF;");
+        exec("DROP TABLE IF EXISTS hashes;");
+        exec("CREATE TABLE hashes (hash BLOB PRIMARY KEY) WITHOUT ROWID;");
+        if (sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO hashes (hash) VALUES (?);", -1, &insert, 0) != SQLITE_OK ||
+            sqlite3_prepare_v2(db, "SELECT 1 FROM hashes WHERE hash = ?;", -1, &lookup, 0) != SQLITE_OK)
+            throw std::runtime_error("SQLite prepare failed");
+        exec("BEGIN;");
+        if (bloom_keys > 0) {
+            bloom_parameters params;
+            params.projected_element_count = bloom_keys;
+            params.false_positive_probability = 0.001;
+            params.compute_optimal_parameters();
+            bloom = new bloom_filter(params);
+            bulk.reserve(BULK_SIZE);
+        }
+    }
+    ~SQLiteStore() {
+        if (!bulk.empty()) {
+            try { flush_bulk(); } catch (const std::exception&) {}
+        }
+        delete bloom;
+        sqlite3_finalize(insert);
+        sqlite3_finalize(lookup);
+        sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+        sqlite3_close(db);
+    }
+    bool is_unique(const Fingerprint& fp) {
+        if (bloom) {
+            if (!bloom->contains(fp)) {
+                bloom->insert(fp);
+                add_to_bulk(fp);
+                return true;
+            }
+            probes++;
+            if (bulk_set.count(fp) || contains_key(fp)) return false;
+            add_to_bulk(fp);  // Bloom false positive
+            return true;
+        }
+        bool unique = insert_key(fp);
+        if (++pending == TRANSACTION_SIZE) {
+            exec("COMMIT; BEGIN;");
+            pending = 0;
+        }
+        return unique;
+    }
+    // Keys that needed an exact check on disk (Bloom positives)
+    size_t disk_probes() const { return probes; }
+
+    // Append every stored fingerprint to keys (used to save a snapshot)
+    void dump(std::vector<Fingerprint>& keys) {
+        if (!bulk.empty()) flush_bulk();
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db, "SELECT hash FROM hashes;", -1, &stmt, 0) != SQLITE_OK)
+            throw std::runtime_error("SQLite prepare failed");
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            if (sqlite3_column_bytes(stmt, 0) == 16)
+                keys.push_back(fingerprint_from_bytes((const unsigned char*)sqlite3_column_blob(stmt, 0)));
+        }
+        sqlite3_finalize(stmt);
+    }
+};
+
+// --------------------------------------------------
+// Hash-sharded SQLite backend
+// --------------------------------------------------
+// Keys are spread over N database files by the top bits of their
+// fingerprint, each owned by one writer thread. Reads are checked in
+// batches: the batch is split by shard and every shard thread gets its
+// part through its queue, in input order, so the first occurrence of a
+// key is still the one kept. The files are scratch and removed at the end.
+class ShardedSQLiteStore {
+    struct Job {
+        const Fingerprint* keys;
+        char* unique;
+        const std::vector<uint32_t>* indices;  // nullptr: stop the thread
+    };
+    struct Shard {
+        std::string filename;
+        SQLiteStore* store = nullptr;
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<Job> queue;
+        StageProfile* profile = nullptr;
+        std::string queue_name;  // for --trace
+        LatencyRecorder* latency = nullptr;
+    };
+    std::vector<Shard*> shards;
+    std::vector<std::vector<uint32_t>> indices;  // per shard, reused
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+    size_t remaining = 0;
+    std::exception_ptr error;
+
+    void worker(Shard* shard) {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(shard->mutex);
+                shard->cv.wait(lock, [&] { return !shard->queue.empty(); });
+                job = shard->queue.front();
+                shard->queue.pop_front();
+                trace_counter(shard->queue_name, shard->queue.size());
+            }
+            if (!job.indices) return;
+            try {
+                StageTimer timer(shard->profile, STAGE_LOOKUP);
+                for (uint32_t i : *job.indices)
+                    job.unique[i] = shard->latency->time([&] { return shard->store->is_unique(job.keys[i]); });
+                shard->profile->add(STAGE_LOOKUP, job.indices->size(), job.indices->size() * sizeof(Fingerprint));
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(done_mutex);
+                if (!error) error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(done_mutex);
+            if (--remaining == 0) done_cv.notify_one();
+        }
+    }
+public:
+    // bloom_keys > 0 puts a Bloom filter sized for that many keys in
+    // front of the databases
+    ShardedSQLiteStore(size_t n, const std::string& prefix, uint64_t bloom_keys = 0) : indices(n) {
+        for (size_t s = 0; s < n; s++) {
+            Shard* shard = new Shard;
+            shard->filename = prefix + ".sqlite" + (n > 1 ? "." + std::to_string(s) : "");
+            shard->store = new SQLiteStore(shard->filename, bloom_keys > 0 ? bloom_keys / n + 1 : 0);
+            shard->profile = new_stage_profile("sqlite shard " + std::to_string(s));
+            shard->queue_name = "sqlite queue " + std::to_string(s);
+            shard->latency = new_latency_recorder("sqlite shard " + std::to_string(s));
+            shards.push_back(shard);
+        }
+        for (Shard* shard : shards) shard->thread = std::thread(&ShardedSQLiteStore::worker, this, shard);
+    }
+    ~ShardedSQLiteStore() {
+        for (Shard* shard : shards) {
+            {
+                std::lock_guard<std::mutex> lock(shard->mutex);
+                shard->queue.push_back(Job{nullptr, nullptr, nullptr});
+            }
+            shard->cv.notify_one();
+        }
+        for (Shard* shard : shards) {
+            shard->thread.join();
+            delete shard->store;
+            std::remove(shard->filename.c_str());
+            std::remove((shard->filename + "-wal").c_str());
+            std::remove((shard->filename + "-shm").c_str());
+            delete shard;
+        }
+    }
+
+    size_t shard_of(const Fingerprint& fp) const {
+        return static_cast<size_t>(((fp.hi >> 32) * shards.size()) >> 32);
+    }
+
+    // Check keys[i] for every i < n with unique[i] set; clear it for
+    // duplicates
+    void is_unique_batch(const Fingerprint* keys, char* unique, size_t n) {
+        for (auto& list : indices) list.clear();
+        for (size_t i = 0; i < n; i++)
+            if (unique[i]) indices[shard_of(keys[i])].push_back(static_cast<uint32_t>(i));
+        {
+            std::lock_guard<std::mutex> lock(done_mutex);
+            remaining = shards.size();
+        }
+        for (size_t s = 0; s < shards.size(); s++) {
+            {
+                std::lock_guard<std::mutex> lock(shards[s]->mutex);
+                shards[s]->queue.push_back(Job{keys, unique, &indices[s]});
+                trace_counter(shards[s]->queue_name, shards[s]->queue.size());
+            }
+            shards[s]->cv.notify_one();
+        }
+        std::unique_lock<std::mutex> lock(done_mutex);
+        done_cv.wait(lock, [&] { return remaining == 0; });
+        if (error) std::rethrow_exception(error);
+    }
+
+    size_t disk_probes() const {
+        size_t n = 0;
+        for (const Shard* shard : shards) n += shard->store->disk_probes();
+        return n;
+    }
+
+    // Append every stored fingerprint to keys (used to save a snapshot)
+    void dump(std::vector<Fingerprint>& keys) {
+        for (Shard* shard : shards) shard->store->dump(keys);
+    }
+};
+
+// --------------------------------------------------
+// Fingerprint snapshots
+// --------------------------------------------------
+// A snapshot is the sorted set of fingerprints kept by an earlier run.
+// File layout (native-endian uint64 words):
+//   magic "DDSNAP01", key count, index bits, reserved
+//   bucket index: (2^bits + 1) offsets, bucket b holds the keys whose
+//                 top `bits` bits equal b
+//   keys: count x (hi, lo), sorted
+// The file is mmap'd read-only, so a lookup touches one index entry and
+// one small bucket instead of loading the whole set in memory.
+static const char SNAPSHOT_MAGIC[8] = {'D','D','S','N','A','P','0','1'};
+static const size_t SNAPSHOT_HEADER_WORDS = 4;
+
+inline uint64_t snapshot_bucket(const Fingerprint& fp, unsigned bits) {
+    return bits == 0 ? 0 : fp.hi >> (64 - bits);
+}
+
+// Aim for ~64 keys (1 KB) per bucket
+unsigned snapshot_index_bits(uint64_t count) {
+    unsigned bits = 0;
+    while (bits < 32 && (count >> (bits + 6)) > 0) bits++;
+    return bits;
+}
+
+class SnapshotSet {
+    void* map = MAP_FAILED;
+    size_t map_len = 0;
+    unsigned bits = 0;
+    const uint64_t* index = nullptr;
+    const Fingerprint* keys = nullptr;
+    uint64_t count = 0;
+public:
+    SnapshotSet(const std::string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Cannot open snapshot: " + filename);
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)(SNAPSHOT_HEADER_WORDS * 8)) {
+            close(fd);
+            throw std::runtime_error("Invalid snapshot: " + filename);
+        }
+        map_len = st.st_size;
+        map = mmap(nullptr, map_len, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) throw std::runtime_error("Cannot mmap snapshot: " + filename);
+        const uint64_t* header = static_cast<const uint64_t*>(map);
+        // Check the header fields before using them in sizes: the key count
+        // must fit in the file before the index size is computed from bits
+        const size_t body = map_len - SNAPSHOT_HEADER_WORDS * 8;
+        bool valid = memcmp(map, SNAPSHOT_MAGIC, 8) == 0 && header[2] <= 32 &&
+                     header[1] <= body / sizeof(Fingerprint);
+        if (valid) {
+            count = header[1];
+            bits = static_cast<unsigned>(header[2]);
+            valid = body - count * sizeof(Fingerprint) == ((size_t(1) << bits) + 1) * 8;
+        }
+        if (!valid) {
+            munmap(map, map_len);
+            throw std::runtime_error("Invalid snapshot: " + filename);
+        }
+        size_t index_words = (size_t(1) << bits) + 1;
+        index = header + SNAPSHOT_HEADER_WORDS;
+        keys = reinterpret_cast<const Fingerprint*>(index + index_words);
+        madvise(map, map_len, MADV_RANDOM);
+    }
+    ~SnapshotSet() { if (map != MAP_FAILED) munmap(map, map_len); }
+    SnapshotSet(const SnapshotSet&) = delete;
+    SnapshotSet& operator=(const SnapshotSet&) = delete;
+
+    bool contains(const Fingerprint& fp) const {
+        uint64_t b = snapshot_bucket(fp, bits);
+        const Fingerprint* first = keys + index[b];
+        const Fingerprint* last = keys + index[b + 1];
+        const Fingerprint* it = std::lower_bound(first, last, fp);
+        return it != last && *it == fp;
+    }
+    uint64_t size() const { return count; }
+    const Fingerprint* begin() const { return keys; }
+    const Fingerprint* end() const { return keys + count; }
+};
+
+// Streaming snapshot writer: keys must be added in ascending order
+// (repeats are skipped), at most `bound` of them. Output goes to a
+// temporary file that is renamed over filename by finish().
+class SnapshotWriter {
+    std::string filename, tmp;
+    std::ofstream out;
+    unsigned bits;
+    std::vector<uint64_t> index;
+    std::vector<Fingerprint> buffer;
+    uint64_t count = 0;
+    Fingerprint last{0, 0};
+    static constexpr size_t BUFFER_KEYS = 1 << 16;
+
+    void flush() {
+        out.write((const char*)buffer.data(), buffer.size() * sizeof(Fingerprint));
+        buffer.clear();
+    }
+public:
+    SnapshotWriter(const std::string& file, uint64_t bound)
+        : filename(file), tmp(file + ".tmp"), out(tmp, std::ios::binary),
+          bits(snapshot_index_bits(bound)), index((size_t(1) << bits) + 1, 0) {
+        if (!out) throw std::runtime_error("Cannot create snapshot: " + tmp);
+        buffer.reserve(BUFFER_KEYS);
+        out.seekp((SNAPSHOT_HEADER_WORDS + index.size()) * 8);
+    }
+    // Heap use of a writer for at most bound keys (bucket index + buffer)
+    static size_t memory_bytes(uint64_t bound) {
+        return ((size_t(1) << snapshot_index_bits(bound)) + 1) * 8 + BUFFER_KEYS * sizeof(Fingerprint);
+    }
+    void add(const Fingerprint& fp) {
+        if (count > 0 && fp == last) return;
+        index[snapshot_bucket(fp, bits) + 1]++;
+        buffer.push_back(fp);
+        last = fp;
+        count++;
+        if (buffer.size() == buffer.capacity()) flush();
+    }
+    uint64_t size() const { return count; }
+    void finish() {
+        flush();
+        // Bucket counts -> start offsets
+        for (size_t b = 1; b < index.size(); b++) index[b] += index[b - 1];
+        uint64_t header[SNAPSHOT_HEADER_WORDS] = {0, count, bits, 0};
+        memcpy(header, SNAPSHOT_MAGIC, 8);
+        out.seekp(0);
+        out.write((const char*)header, sizeof(header));
+        out.write((const char*)index.data(), index.size() * 8);
+        out.close();
+        if (!out || std::rename(tmp.c_str(), filename.c_str()) != 0)
+            throw std::runtime_error("Cannot write snapshot: " + filename);
+    }
+};
+
+// Write the union of keys (sorted in place) and the previous snapshots
+void write_snapshot(const std::string& filename, std::vector<Fingerprint>& keys,
+                    const std::vector<SnapshotSet*>& previous) {
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    // Cursors over every sorted input; merged with a linear scan since
+    // there are only a handful of them
+    std::vector<std::pair<const Fingerprint*, const Fingerprint*>> inputs;
+    uint64_t bound = keys.size();
+    inputs.emplace_back(keys.data(), keys.data() + keys.size());
+    for (const SnapshotSet* snap : previous) {
+        inputs.emplace_back(snap->begin(), snap->end());
+        bound += snap->size();
+    }
+
+    SnapshotWriter writer(filename, bound);
+    while (true) {
+        const Fingerprint* next = nullptr;
+        for (auto& in : inputs)
+            if (in.first != in.second && (!next || *in.first < *next)) next = in.first;
+        if (!next) break;
+        Fingerprint fp = *next;
+        for (auto& in : inputs)
+            if (in.first != in.second && *in.first == fp) ++in.first;
+        writer.add(fp);
+    }
+    writer.finish();
+}
+
+// --------------------------------------------------
+// Two-pass exact backend (Bloom pre-filter + exact check of positives)
+// --------------------------------------------------
+// Pass 1 writes every Bloom negative straight to the output: it is
+// certainly the first occurrence of its key. Bloom positives are either
+// duplicates or false positives; they are spilled (fingerprint + records)
+// to temporary files, and their fingerprints form the candidate set.
+//
+// A key has at most one Bloom negative and it comes before any positive
+// for the same key, so pass 2 only re-reads two small streams: the
+// negative fingerprints, to mark which candidates were already written,
+// then the spilled positives in order, keeping the first one of each
+// candidate not yet written. Rescued false positives are appended to the
+// output after the pass 1 reads.
+class TwoPassStore {
+    bloom_filter bloom;
+    std::string prefix, neg_file, pos_fp_file, pos1_file, pos2_file;
+    FILE* neg = nullptr;
+    FILE* pos_fp = nullptr;
+    gzFile pos1 = nullptr, pos2 = nullptr;
+    std::vector<Fingerprint> candidates;  // sorted up to `compacted`
+    size_t compacted = 0;
+    std::vector<Fingerprint> rescued;
+
+    void compact() {
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+        compacted = candidates.size();
+    }
+public:
+    TwoPassStore(const bloom_parameters& params, const std::string& tmp_prefix)
+        : bloom(params), prefix(tmp_prefix),
+          neg_file(tmp_prefix + ".neg"), pos_fp_file(tmp_prefix + ".pos"),
+          pos1_file(tmp_prefix + ".pos_R1.fq"), pos2_file(tmp_prefix + ".pos_R2.fq") {
+        neg = fopen(neg_file.c_str(), "wb");
+        pos_fp = fopen(pos_fp_file.c_str(), "wb");
+        pos1 = gzopen(pos1_file.c_str(), "wT");  // transparent: no compression
+        pos2 = gzopen(pos2_file.c_str(), "wT");
+        if (!neg || !pos_fp || !pos1 || !pos2)
+            throw std::runtime_error("Cannot create temporary files " + tmp_prefix + ".*");
+    }
+    ~TwoPassStore() {
+        if (neg) fclose(neg);
+        if (pos_fp) fclose(pos_fp);
+        if (pos1) gzclose(pos1);
+        if (pos2) gzclose(pos2);
+        std::remove(neg_file.c_str());
+        std::remove(pos_fp_file.c_str());
+        std::remove(pos1_file.c_str());
+        std::remove(pos2_file.c_str());
+    }
+
+    // Pass 1: true if the pair is certainly new (write it now), false if
+    // it was set aside for pass 2
+    bool is_unique(const Fingerprint& fp, const FastqRecord& r1, const FastqRecord& r2) {
+        if (!bloom.contains(fp)) {
+            bloom.insert(fp);
+            if (fwrite(&fp, sizeof(fp), 1, neg) != 1) throw std::runtime_error("Cannot write " + neg_file);
+            return true;
+        }
+        if (fwrite(&fp, sizeof(fp), 1, pos_fp) != 1) throw std::runtime_error("Cannot write " + pos_fp_file);
+        write_fastq_record(pos1, r1);
+        write_fastq_record(pos2, r2);
+        candidates.push_back(fp);
+        if (candidates.size() >= 2 * compacted + 1024) compact();
+        return false;
     }
-    return hex;
+    size_t candidate_count() const { return candidates.size(); }
+
+    // Pass 2: append the false positives to out1/out2, return their number
+    size_t resolve(gzFile out1, gzFile out2) {
+        compact();
+        // Closing flushes the buffers, and gzclose reports earlier write errors
+        bool ok = fclose(neg) == 0;
+        ok = fclose(pos_fp) == 0 && ok;
+        ok = gzclose(pos1) == Z_OK && ok;
+        ok = gzclose(pos2) == Z_OK && ok;
+        neg = pos_fp = nullptr;
+        pos1 = pos2 = nullptr;
+        if (!ok) throw std::runtime_error("Cannot write temporary files " + prefix + ".*");
+
+        std::vector<bool> written(candidates.size(), false);
+        auto find = [&](const Fingerprint& fp) -> size_t {
+            auto it = std::lower_bound(candidates.begin(), candidates.end(), fp);
+            return (it != candidates.end() && *it == fp) ? it - candidates.begin() : candidates.size();
+        };
+
+        FILE* f = fopen(neg_file.c_str(), "rb");
+        if (!f) throw std::runtime_error("Cannot reopen " + neg_file);
+        std::vector<Fingerprint> buf(1 << 16);
+        size_t n;
+        while ((n = fread(buf.data(), sizeof(Fingerprint), buf.size(), f)) > 0) {
+            for (size_t i = 0; i < n; i++) {
+                size_t c = find(buf[i]);
+                if (c < candidates.size()) written[c] = true;
+            }
+        }
+        fclose(f);
+
+        f = fopen(pos_fp_file.c_str(), "rb");
+        gzFile in1 = gzopen(pos1_file.c_str(), "rb");
+        gzFile in2 = gzopen(pos2_file.c_str(), "rb");
+        if (!f || !in1 || !in2) throw std::runtime_error("Cannot reopen two-pass spill files");
+        FastqRecord r1, r2;
+        Fingerprint fp;
+        while (fread(&fp, sizeof(fp), 1, f) == 1 &&
+               read_fastq_record(in1, r1) && read_fastq_record(in2, r2)) {
+            size_t c = find(fp);
+            if (!written[c]) {
+                written[c] = true;
+                write_fastq_record(out1, r1);
+                write_fastq_record(out2, r2);
+                rescued.push_back(fp);
+            }
+        }
+        fclose(f);
+        gzclose(in1);
+        gzclose(in2);
+        return rescued.size();
+    }
+
+    // Append every kept fingerprint to keys (call after resolve)
+    void dump(std::vector<Fingerprint>& keys) {
+        FILE* f = fopen(neg_file.c_str(), "rb");
+        if (!f) throw std::runtime_error("Cannot reopen " + neg_file);
+        Fingerprint fp;
+        while (fread(&fp, sizeof(fp), 1, f) == 1) keys.push_back(fp);
+        fclose(f);
+        keys.insert(keys.end(), rescued.begin(), rescued.end());
+    }
+};
+
+// --------------------------------------------------
+// Memory budget helpers
+// --------------------------------------------------
+// Parse sizes such as "512M", "8G" or "1.5g" (powers of 1024)
+size_t parse_size(const std::string& text) {
+    size_t pos = 0;
+    double value = std::stod(text, &pos);
+    std::string unit = text.substr(pos);
+    if (!unit.empty() && (unit.back() == 'B' || unit.back() == 'b')) unit.pop_back();
+    double mult = 1;
+    if (unit == "K" || unit == "k") mult = 1024.0;
+    else if (unit == "M" || unit == "m") mult = 1024.0 * 1024;
+    else if (unit == "G" || unit == "g") mult = 1024.0 * 1024 * 1024;
+    else if (unit == "T" || unit == "t") mult = 1024.0 * 1024 * 1024 * 1024;
+    else if (!unit.empty()) throw std::runtime_error("Bad size: " + text);
+    return static_cast<size_t>(value * mult);
+}
+
+// Memory limit of this process: the cgroup limit (v2, then v1) when there
+// is one, physical RAM otherwise
+size_t default_memory_limit() {
+    size_t ram = static_cast<size_t>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGE_SIZE);
+    const char* files[] = {"/sys/fs/cgroup/memory.max",
+                           "/sys/fs/cgroup/memory/memory.limit_in_bytes"};
+    for (const char* file : files) {
+        std::ifstream in(file);
+        std::string value;
+        if (in >> value && value != "max") {
+            size_t limit = std::stoull(value);
+            if (limit > 0 && limit < ram) return limit;
+        }
+    }
+    return ram;
+}
+
+// Share of max_memory (0: default limit) a backend may use, leaving room
+// for the I/O buffers and the rest of the process
+size_t backend_memory_budget(size_t max_memory) {
+    if (max_memory == 0) max_memory = default_memory_limit();
+    const size_t reserve = 64ULL << 20;
+    return max_memory > 2 * reserve ? max_memory - reserve : max_memory / 2;
+}
+
+// --------------------------------------------------
+// Adaptive backend (exact, bounded memory)
+// --------------------------------------------------
+// Keys go to an open-addressing table of fingerprints that doubles while
+// the old and new arrays both fit in the budget. When the table is full
+// and cannot grow, its keys are sorted and spilled to a run on disk using
+// the snapshot format, which is partitioned by hash prefix through its
+// bucket index, and the table is emptied. Lookups check the table, then
+// the mmap'd runs. Runs of similar size are merged (streaming) so there
+// are only O(log n) of them. The snapshot writer of a spill or merge
+// holds a bucket index that grows with the keys on disk, so it is charged
+// to the budget too, and the table shrinks after a spill if needed.
+class AdaptiveStore {
+    size_t budget;
+    std::string tmp_prefix;
+    std::vector<Fingerprint> table;  // {0,0} marks an empty slot
+    size_t mask = 0, count = 0;
+    std::vector<SnapshotSet*> runs;
+    std::vector<std::string> run_files;
+    size_t run_seq = 0, spills = 0;
+
+    static bool empty(const Fingerprint& fp) { return fp.hi == 0 && fp.lo == 0; }
+    size_t max_count() const { return table.size() - table.size() / 4; }
+
+    // Table of the given capacity plus the writer of a spill or merge
+    // of every key
+    size_t peak_bytes(size_t capacity) const {
+        uint64_t keys = disk_keys() + capacity - capacity / 4;
+        return capacity * sizeof(Fingerprint) + SnapshotWriter::memory_bytes(keys);
+    }
+
+    size_t slot(const Fingerprint& fp) const {
+        size_t i = fp.lo & mask;
+        while (!empty(table[i]) && table[i] != fp) i = (i + 1) & mask;
+        return i;
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<Fingerprint> old(capacity, Fingerprint{0, 0});
+        old.swap(table);
+        mask = capacity - 1;
+        for (const Fingerprint& fp : old)
+            if (!empty(fp)) table[slot(fp)] = fp;
+    }
+
+    void spill() {
+        std::string file = tmp_prefix + ".run" + std::to_string(run_seq++);
+        size_t capacity = table.size();
+        table.erase(std::remove_if(table.begin(), table.end(), empty), table.end());
+        write_snapshot(file, table, {});
+        std::vector<Fingerprint>().swap(table);
+        count = 0;
+        spills++;
+        runs.push_back(new SnapshotSet(file));
+        run_files.push_back(file);
+
+        // Merge the newest runs while they are of similar size
+        while (runs.size() >= 2 && runs[runs.size() - 2]->size() <= 2 * runs.back()->size()) {
+            std::string merged = tmp_prefix + ".run" + std::to_string(run_seq++);
+            std::vector<Fingerprint> none;
+            write_snapshot(merged, none, {runs[runs.size() - 2], runs.back()});
+            for (int k = 0; k < 2; k++) {
+                delete runs.back();
+                runs.pop_back();
+                std::remove(run_files.back().c_str());
+                run_files.pop_back();
+            }
+            runs.push_back(new SnapshotSet(merged));
+            run_files.push_back(merged);
+        }
+
+        while (capacity > 1024 && peak_bytes(capacity) > budget) capacity /= 2;
+        table.assign(capacity, Fingerprint{0, 0});
+        mask = capacity - 1;
+    }
+public:
+    AdaptiveStore(size_t budget_bytes, const std::string& prefix)
+        : budget(budget_bytes), tmp_prefix(prefix) {
+        size_t capacity = 1 << 16;
+        while (capacity > 1024 && peak_bytes(capacity) > budget) capacity /= 2;
+        table.assign(capacity, Fingerprint{0, 0});
+        mask = capacity - 1;
+    }
+    ~AdaptiveStore() {
+        for (SnapshotSet* run : runs) delete run;
+        for (const std::string& file : run_files) std::remove(file.c_str());
+    }
+
+    bool is_unique(Fingerprint fp) {
+        if (empty(fp)) fp.lo = 1;  // keep {0,0} free as the empty marker
+        size_t i = slot(fp);
+        if (!empty(table[i])) return false;
+        for (const SnapshotSet* run : runs)
+            if (run->contains(fp)) return false;
+        if (count + 1 > max_count()) {
+            size_t capacity = table.size();
+            if (3 * capacity * sizeof(Fingerprint) <= budget && peak_bytes(2 * capacity) <= budget)
+                rehash(2 * capacity);
+            else spill();
+            i = slot(fp);
+        }
+        table[i] = fp;
+        count++;
+        return true;
+    }
+
+    size_t memory_keys() const { return count; }
+    size_t memory_bytes() const { return table.size() * sizeof(Fingerprint); }
+    size_t spill_count() const { return spills; }
+    size_t disk_keys() const {
+        size_t n = 0;
+        for (const SnapshotSet* run : runs) n += run->size();
+        return n;
+    }
+
+    // Write the in-memory keys, the runs and the previous snapshots to a
+    // new snapshot (the table is consumed)
+    void save_snapshot(const std::string& filename, const std::vector<SnapshotSet*>& previous) {
+        table.erase(std::remove_if(table.begin(), table.end(), empty), table.end());
+        std::vector<SnapshotSet*> inputs(runs);
+        inputs.insert(inputs.end(), previous.begin(), previous.end());
+        write_snapshot(filename, table, inputs);
+        count = 0;
+    }
+};
+
+// --------------------------------------------------
+// Memory-mapped hash table backend (exact)
+// --------------------------------------------------
+// A linear-probing table of fingerprints in a file mapped with MAP_SHARED,
+// sized from the read count (load <= 0.7). The OS page cache decides which
+// parts stay in RAM, so a table somewhat larger than memory gets slower
+// instead of failing. The file is unlinked as soon as it is mapped, so it
+// never outlives the process.
+class MmapHashStore {
+    std::string filename;
+    Fingerprint* table = nullptr;
+    size_t capacity = 0, mask = 0, count = 0;
+
+    static bool empty(const Fingerprint& fp) { return fp.hi == 0 && fp.lo == 0; }
+
+    static Fingerprint* map_table(const std::string& file, size_t slots) {
+        int fd = open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) throw std::runtime_error("Cannot create " + file);
+        size_t bytes = slots * sizeof(Fingerprint);
+        if (ftruncate(fd, bytes) != 0) {
+            close(fd);
+            throw std::runtime_error("Cannot resize " + file);
+        }
+        void* map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        unlink(file.c_str());
+        if (map == MAP_FAILED) throw std::runtime_error("Cannot mmap " + file);
+        madvise(map, bytes, MADV_RANDOM);
+        return static_cast<Fingerprint*>(map);
+    }
+
+    size_t slot(const Fingerprint& fp) const {
+        size_t i = fp.lo & mask;
+        while (!empty(table[i]) && table[i] != fp) i = (i + 1) & mask;
+        return i;
+    }
+
+    // Only needed when more keys arrive than the table was sized for
+    void grow() {
+        Fingerprint* old = table;
+        size_t old_capacity = capacity;
+        capacity *= 2;
+        mask = capacity - 1;
+        table = map_table(filename, capacity);
+        for (size_t i = 0; i < old_capacity; i++)
+            if (!empty(old[i])) table[slot(old[i])] = old[i];
+        munmap(old, old_capacity * sizeof(Fingerprint));
+    }
+public:
+    MmapHashStore(const std::string& file, size_t expected_keys) : filename(file) {
+        capacity = 1024;
+        while (capacity * 7 / 10 < expected_keys) capacity *= 2;
+        mask = capacity - 1;
+        table = map_table(filename, capacity);
+    }
+    ~MmapHashStore() { munmap(table, capacity * sizeof(Fingerprint)); }
+
+    bool is_unique(Fingerprint fp) {
+        if (empty(fp)) fp.lo = 1;  // keep {0,0} free as the empty marker
+        size_t i = slot(fp);
+        if (!empty(table[i])) return false;
+        if (count + 1 > capacity * 9 / 10) {
+            grow();
+            i = slot(fp);
+        }
+        table[i] = fp;
+        count++;
+        return true;
+    }
+    size_t size() const { return count; }
+    size_t file_bytes() const { return capacity * sizeof(Fingerprint); }
+    double load() const { return double(count) / capacity; }
+
+    // Append every stored fingerprint to keys (used to save a snapshot)
+    void dump(std::vector<Fingerprint>& keys) {
+        madvise(table, capacity * sizeof(Fingerprint), MADV_SEQUENTIAL);
+        for (size_t i = 0; i < capacity; i++)
+            if (!empty(table[i])) keys.push_back(table[i]);
+    }
+};
+
+// --------------------------------------------------
+// CPU-specific kernels
+// --------------------------------------------------
+// dedup is compiled for baseline x86-64, so that one binary runs on any
+// machine. Kernels that gain from newer instructions are also compiled
+// for AVX2 and AVX-512 (target attributes), and the best version for the
+// CPU is chosen at the first call with __builtin_cpu_supports. The
+// environment variable DEDUP_SIMD=generic|avx2|avx512 forces a version
+// (for benchmarks).
+
+// Set bits in n bytes
+size_t popcount_bytes_generic(const unsigned char* p, size_t n) {
+    size_t set = 0, i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, p + i, 8);
+        set += __builtin_popcountll(word);
+    }
+    for (; i < n; i++) set += __builtin_popcount(p[i]);
+    return set;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define DEDUP_X86_KERNELS 1
+
+// Nibble lookup with vpshufb, bytes summed with vpsadbw (Mula, Kurz and
+// Lemire, "Faster population counts using AVX2 instructions", 2018)
+__attribute__((target("avx2")))
+size_t popcount_bytes_avx2(const unsigned char* p, size_t n) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low_mask));
+        __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+    }
+    size_t set = _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+                 _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+    return set + popcount_bytes_generic(p + i, n - i);
+}
+
+// One vpopcntq per 64 bytes
+__attribute__((target("avx512f,avx512vpopcntdq")))
+size_t popcount_bytes_avx512(const unsigned char* p, size_t n) {
+    __m512i total = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64)
+        total = _mm512_add_epi64(total, _mm512_popcnt_epi64(_mm512_loadu_si512(p + i)));
+    uint64_t lanes[8];
+    _mm512_storeu_si512(lanes, total);
+    size_t set = 0;
+    for (uint64_t lane : lanes) set += lane;
+    return set + popcount_bytes_generic(p + i, n - i);
+}
+#endif
+
+enum SimdLevel { SIMD_GENERIC, SIMD_AVX2, SIMD_AVX512 };
+const char* const SIMD_NAMES[] = {"generic", "avx2", "avx512"};
+
+SimdLevel detect_simd_level() {
+    SimdLevel best = SIMD_GENERIC;
+#ifdef DEDUP_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) best = SIMD_AVX512;
+    else if (__builtin_cpu_supports("avx2")) best = SIMD_AVX2;
+#endif
+    const char* forced = std::getenv("DEDUP_SIMD");
+    if (forced) {
+        for (int level = SIMD_GENERIC; level <= best; level++)
+            if (std::strcmp(forced, SIMD_NAMES[level]) == 0) return static_cast<SimdLevel>(level);
+    }
+    return best;
+}
+
+SimdLevel simd_level() {
+    static const SimdLevel level = detect_simd_level();
+    return level;
+}
+
+size_t popcount_bytes(const unsigned char* p, size_t n) {
+    typedef size_t (*Kernel)(const unsigned char*, size_t);
+    static const Kernel kernel = [] {
+        Kernel k = popcount_bytes_generic;
+#ifdef DEDUP_X86_KERNELS
+        if (simd_level() == SIMD_AVX512) k = popcount_bytes_avx512;
+        else if (simd_level() == SIMD_AVX2) k = popcount_bytes_avx2;
+#endif
+        return k;
+    }();
+    return kernel(p, n);
 }
 
 // --------------------------------------------------
-// FASTQ record structure
+// Bloom filter backend (approximate)
 // --------------------------------------------------
-struct FastqRecord {
-    std::string id, seq, plus, qual;
+// The filter is sized from the read count, so it overfills when that
+// count is wrong (e.g. more keys arrive through several inputs than
+// expected). Every 1/16 of the planned keys, the fraction of set bits is
+// measured with word popcounts; the real false positive rate is
+// fill^hashes. Past the target rate, either a warning is printed, or
+// with grow a new sub-filter is added for twice as many keys at half the
+// rate (scalable Bloom filter, Almeida et al. 2007), so the overall rate
+// stays below twice the target.
+class BloomStore {
+    struct SubFilter {
+        bloom_filter* filter;
+        unsigned hashes;
+        uint64_t check_every, next_check;
+        double fill;
+    };
+    std::vector<SubFilter> filters;
+    uint64_t base_keys;
+    double target_fpp;
+    bool grow;
+    bool warned = false;
+
+    static double fill_ratio(const bloom_filter& f) {
+        size_t bytes = f.size() / bits_per_char;
+        return bytes ? double(popcount_bytes(f.table(), bytes)) / (8.0 * bytes) : 0.0;
+    }
+
+    void add_filter() {
+        size_t level = filters.size();
+        bloom_parameters params;
+        params.projected_element_count = base_keys << level;
+        params.false_positive_probability = target_fpp / double(uint64_t(1) << level);
+        params.compute_optimal_parameters();
+        uint64_t every = std::max<uint64_t>(params.projected_element_count / 16, 1024);
+        filters.push_back({new bloom_filter(params), params.optimal_parameters.number_of_hashes,
+                           every, every, 0.0});
+    }
+
+    static double sub_fpp(const SubFilter& f) { return std::pow(f.fill, double(f.hashes)); }
+
+    void check() {
+        SubFilter& f = filters.back();
+        f.fill = fill_ratio(*f.filter);
+        f.next_check += f.check_every;
+        double limit = target_fpp / double(uint64_t(1) << (filters.size() - 1));
+        if (sub_fpp(f) <= limit) return;
+        if (grow) {
+            add_filter();
+        } else if (!warned) {
+            std::cerr << "\nWarning: the Bloom filter is overfilled (" << f.filter->element_count()
+                      << " keys for " << base_keys << " planned); the false positive rate now exceeds "
+                      << std::scientific << std::setprecision(0) << target_fpp
+                      << std::fixed << std::setprecision(1) << ". Use --bloom-grow to add filters as needed.\n";
+            warned = true;
+        }
+    }
+public:
+    BloomStore(uint64_t expected_keys, double fpp, bool grow_filters)
+        : base_keys(std::max<uint64_t>(expected_keys, 1)), target_fpp(fpp), grow(grow_filters) {
+        add_filter();
+    }
+    ~BloomStore() { for (SubFilter& f : filters) delete f.filter; }
+
+    bool is_unique(const Fingerprint& fp) {
+        for (const SubFilter& f : filters)
+            if (f.filter->contains(fp)) return false;
+        SubFilter& last = filters.back();
+        last.filter->insert(fp);
+        if (last.filter->element_count() >= last.next_check) check();
+        return true;
+    }
+
+    // Measure the newest filter again (older ones no longer change)
+    void refresh() { filters.back().fill = fill_ratio(*filters.back().filter); }
+
+    size_t filter_count() const { return filters.size(); }
+    size_t memory_bytes() const {
+        size_t n = 0;
+        for (const SubFilter& f : filters) n += f.filter->size() / bits_per_char;
+        return n;
+    }
+    double fill() const { return filters.back().fill; }
+    // Measured rate: a key is a false positive if any sub-filter matches
+    double fpp() const {
+        double miss = 1.0;
+        for (const SubFilter& f : filters) miss *= 1.0 - sub_fpp(f);
+        return 1.0 - miss;
+    }
+    double target() const { return target_fpp; }
+    // The same from the number of inserted keys (bloom_filter::effective_fpp)
+    double effective_fpp() const {
+        double miss = 1.0;
+        for (const SubFilter& f : filters) miss *= 1.0 - f.filter->effective_fpp();
+        return 1.0 - miss;
+    }
 };
 
 // --------------------------------------------------
-// Read next FASTQ record
+// Quotient filter backend (approximate, with counts)
 // --------------------------------------------------
-bool read_fastq_record(gzFile file, FastqRecord &rec) {
-    char buf[10000];
-    if (!gzgets(file, buf, sizeof(buf))) return false;
-    rec.id = buf;
-    if (!gzgets(file, buf, sizeof(buf))) return false;
-    rec.seq = buf;
-    if (!gzgets(file, buf, sizeof(buf))) return false;
-    rec.plus = buf;
-    if (!gzgets(file, buf, sizeof(buf))) return false;
-    rec.qual = buf;
-    return true;
-}
+// One quotient filter sized from the read count, with one remainder bit
+// more than asked for. When it is full, a filter twice as large with one
+// more remainder bit again is appended: a key is counted in the filter
+// that holds it, and new keys go to the newest one. The filters' false
+// positive rates halve in turn, so their sum stays below the target.
+class QuotientStore {
+    std::vector<QuotientFilter*> filters;
+public:
+    // About 2^-remainder_bits false positives in total
+    QuotientStore(uint64_t expected_keys, unsigned remainder_bits) {
+        filters.push_back(new QuotientFilter(expected_keys, remainder_bits + 1));
+    }
+    ~QuotientStore() { for (QuotientFilter* f : filters) delete f; }
+
+    // Count of the key before this occurrence, 0 if it is new
+    uint64_t insert(const Fingerprint& fp) {
+        for (size_t i = 0; i + 1 < filters.size(); i++)
+            if (uint64_t count = filters[i]->increment(fp.hi)) return count;
+        QuotientFilter* last = filters.back();
+        uint64_t count = last->insert(fp.hi);
+        if (last->full()) filters.push_back(new QuotientFilter(2 * last->size(), last->remainder_bits() + 1));
+        return count;
+    }
+
+    size_t filter_count() const { return filters.size(); }
+    uint64_t size() const {
+        uint64_t n = 0;
+        for (const QuotientFilter* f : filters) n += f->size();
+        return n;
+    }
+    size_t memory_bytes() const {
+        size_t n = 0;
+        for (const QuotientFilter* f : filters) n += f->memory_bytes();
+        return n;
+    }
+    double load() const { return double(size()) / slots(); }
+    uint64_t slots() const {
+        uint64_t n = 0;
+        for (const QuotientFilter* f : filters) n += f->slots();
+        return n;
+    }
+    double fpp() const {
+        double p = 0;
+        for (const QuotientFilter* f : filters) p += f->fpp();
+        return p;
+    }
+
+    // Calls f(count) once for every stored key
+    template <typename F>
+    void for_each_count(F f) const {
+        for (const QuotientFilter* q : filters) q->for_each([&](uint64_t, uint64_t count) { f(count); });
+    }
+};
 
 // --------------------------------------------------
-// Write FASTQ record
+// Cuckoo filter backend (approximate)
 // --------------------------------------------------
-void write_fastq_record(gzFile file, const FastqRecord &rec) {
-    gzputs(file, rec.id.c_str());
-    gzputs(file, rec.seq.c_str());
-    gzputs(file, rec.plus.c_str());
-    gzputs(file, rec.qual.c_str());
-}
+// One cuckoo filter sized from the read count. If it fills up (a failed
+// relocation chain), a new filter twice as large is appended: lookups
+// check every filter and inserts go to the newest one, so the backend
+// keeps working and its false positive rate grows by at most the sum of
+// the filters' rates.
+class CuckooStore {
+    std::vector<CuckooFilter*> filters;
+public:
+    CuckooStore(uint64_t expected_keys) { filters.push_back(new CuckooFilter(expected_keys)); }
+    ~CuckooStore() { for (CuckooFilter* f : filters) delete f; }
+
+    bool is_unique(const Fingerprint& fp) {
+        for (const CuckooFilter* f : filters)
+            if (f->contains(fp.hi, fp.lo)) return false;
+        if (!filters.back()->insert(fp.hi, fp.lo))
+            filters.push_back(new CuckooFilter(2 * filters.back()->size()));
+        return true;
+    }
+    size_t filter_count() const { return filters.size(); }
+    size_t memory_bytes() const {
+        size_t n = 0;
+        for (const CuckooFilter* f : filters) n += f->memory_bytes();
+        return n;
+    }
+    double fpp() const {
+        double p = 0;
+        for (const CuckooFilter* f : filters) p += f->fpp();
+        return p;
+    }
+};
 
 // --------------------------------------------------
-// Count number of fastq records
+// Elias-Fano compressed backend (exact by 64-bit fingerprint)
 // --------------------------------------------------
-size_t count_fastq_records(const std::string& filename) {
-    gzFile f = gzopen(filename.c_str(), "rb");
-    if (!f) throw std::runtime_error("Cannot open file: " + filename);
-    char buf[8192];
-    size_t lines = 0;
-    while (gzgets(f, buf, sizeof(buf))) ++lines;
-    gzclose(f);
-    return lines / 4;
-}
+// New keys (the top 64 fingerprint bits) go to a small open-addressing
+// buffer. When it is full, its keys are sorted, split into 16 partitions
+// by their top 4 bits, and each part becomes an Elias-Fano block over
+// the remaining 60 bits. Within a partition, blocks of similar size are
+// merged, so a partition holds O(log n) blocks and a lookup probes the
+// buffer plus those blocks. Merging one partition at a time keeps the
+// extra memory of a merge to ~1/16 of the set. At 2^31 keys this is
+// ~36 bits per key.
+class EliasFanoStore {
+    static const unsigned PARTITION_BITS = 4;
+    static const unsigned KEY_BITS = 64 - PARTITION_BITS;
+    static const size_t BUFFER_KEYS = 1 << 20;
+    std::vector<uint64_t> buffer;  // 0 marks an empty slot
+    size_t buffer_count = 0, mask;
+    std::vector<std::vector<EliasFano*>> partitions;
+    uint64_t count = 0;
+
+    static uint64_t low_bits(uint64_t key) { return key & ((uint64_t(1) << KEY_BITS) - 1); }
+
+    size_t slot(uint64_t key) const {
+        size_t i = (key * 0x9e3779b97f4a7c15ULL) >> 20 & mask;
+        while (buffer[i] != 0 && buffer[i] != key) i = (i + 1) & mask;
+        return i;
+    }
+
+    static EliasFano* merge(const EliasFano* a, const EliasFano* b) {
+        EliasFano* out = new EliasFano(a->size() + b->size(), KEY_BITS);
+        EliasFano::Iterator ia(a), ib(b);
+        uint64_t va = 0, vb = 0;
+        bool ha = ia.next(va), hb = ib.next(vb);
+        while (ha || hb) {
+            if (hb && (!ha || vb < va)) { out->push_back(vb); hb = ib.next(vb); }
+            else { out->push_back(va); ha = ia.next(va); }
+        }
+        return out;
+    }
+
+    void flush() {
+        std::vector<uint64_t> keys;
+        keys.reserve(buffer_count);
+        for (uint64_t key : buffer)
+            if (key != 0) keys.push_back(key);
+        std::sort(keys.begin(), keys.end());
+        std::fill(buffer.begin(), buffer.end(), 0);
+        buffer_count = 0;
+
+        size_t begin = 0;
+        while (begin < keys.size()) {
+            uint64_t p = keys[begin] >> KEY_BITS;
+            size_t end = begin;
+            while (end < keys.size() && keys[end] >> KEY_BITS == p) end++;
+            EliasFano* block = new EliasFano(end - begin, KEY_BITS);
+            for (size_t i = begin; i < end; i++) block->push_back(low_bits(keys[i]));
+            std::vector<EliasFano*>& blocks = partitions[p];
+            blocks.push_back(block);
+            while (blocks.size() >= 2 && blocks[blocks.size() - 2]->size() <= 2 * blocks.back()->size()) {
+                EliasFano* merged = merge(blocks[blocks.size() - 2], blocks.back());
+                for (int k = 0; k < 2; k++) {
+                    delete blocks.back();
+                    blocks.pop_back();
+                }
+                blocks.push_back(merged);
+            }
+            begin = end;
+        }
+    }
+public:
+    EliasFanoStore() : buffer(2 * BUFFER_KEYS, 0), mask(2 * BUFFER_KEYS - 1),
+                       partitions(size_t(1) << PARTITION_BITS) {}
+    ~EliasFanoStore() {
+        for (auto& blocks : partitions)
+            for (EliasFano* block : blocks) delete block;
+    }
+
+    bool is_unique(const Fingerprint& fp) {
+        uint64_t key = fp.hi ? fp.hi : 1;  // 0 marks empty buffer slots
+        size_t i = slot(key);
+        if (buffer[i] != 0) return false;
+        for (const EliasFano* block : partitions[key >> KEY_BITS])
+            if (block->contains(low_bits(key))) return false;
+        buffer[i] = key;
+        count++;
+        if (++buffer_count == BUFFER_KEYS) flush();
+        return true;
+    }
+
+    uint64_t size() const { return count; }
+    size_t block_count() const {
+        size_t n = 0;
+        for (const auto& blocks : partitions) n += blocks.size();
+        return n;
+    }
+    size_t compressed_bytes() const {
+        size_t n = 0;
+        for (const auto& blocks : partitions)
+            for (const EliasFano* block : blocks) n += block->memory_bytes();
+        return n;
+    }
+    size_t memory_bytes() const { return compressed_bytes() + buffer.size() * sizeof(uint64_t); }
+};
 
 // --------------------------------------------------
-// Extract barcode from FASTQ header
+// Verified backend (exact, fingerprint plus spilled key bytes)
 // --------------------------------------------------
-std::string extract_barcode_from_name(const std::string& header) {
-    size_t space_pos = header.find(' ');
-    std::string main_part = (space_pos == std::string::npos) ? header : header.substr(0, space_pos);
-    size_t last_colon = main_part.rfind(':');
-    if (last_colon == std::string::npos) return "";
-    return main_part.substr(last_colon + 1);
-}
+// The table holds 13-byte entries: the top 64 fingerprint bits and the
+// 40-bit ordinal of the unique read pair that produced them (up to 2^40,
+// about 10^12, unique read pairs). The hashed bytes of
+// every unique read pair are appended to a data file, and their start
+// offsets to an offsets file, both in --tmp-dir. When a fingerprint
+// matches, the earlier bytes are read back and compared, so the result
+// does not depend on the hash being collision-free: a collision only
+// costs one more entry with the same fingerprint. The files are written
+// through 1 MB buffers, and recent read pairs are compared from them.
+class VerifiedStore {
+    struct __attribute__((packed)) Entry {
+        uint64_t fp;  // 0 marks an empty slot
+        uint32_t ordinal_low;
+        uint8_t ordinal_high;
+
+        uint64_t ordinal() const { return ordinal_low | uint64_t(ordinal_high) << 32; }
+    };
+    static const uint64_t MAX_KEYS = uint64_t(1) << 40;
+    static const size_t BUFFER_BYTES = 1 << 20;
+
+    std::vector<Entry> table;
+    size_t mask = 0, count = 0;
+    int data_fd = -1, offsets_fd = -1;
+    std::string data_buffer, scratch;  // scratch: bytes read back, reused
+    std::vector<uint64_t> offset_buffer;
+    uint64_t data_flushed = 0, data_size = 0, offsets_flushed = 0;
+    size_t verifications = 0, collisions = 0;
+
+    static int open_scratch(const std::string& file) {
+        int fd = open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) throw std::runtime_error("Cannot create " + file);
+        unlink(file.c_str());
+        return fd;
+    }
+
+    static void write_all(int fd, const void* data, size_t bytes) {
+        const char* p = static_cast<const char*>(data);
+        while (bytes > 0) {
+            ssize_t w = write(fd, p, bytes);
+            if (w <= 0) throw std::runtime_error("Cannot write key bytes to --tmp-dir");
+            p += w;
+            bytes -= w;
+        }
+    }
+
+    static void read_all(int fd, void* data, size_t bytes, uint64_t offset) {
+        char* p = static_cast<char*>(data);
+        while (bytes > 0) {
+            ssize_t r = pread(fd, p, bytes, offset);
+            if (r <= 0) throw std::runtime_error("Cannot read key bytes from --tmp-dir");
+            p += r;
+            bytes -= r;
+            offset += r;
+        }
+    }
+
+    void flush() {
+        write_all(data_fd, data_buffer.data(), data_buffer.size());
+        write_all(offsets_fd, offset_buffer.data(), offset_buffer.size() * sizeof(uint64_t));
+        data_flushed += data_buffer.size();
+        offsets_flushed += offset_buffer.size();
+        data_buffer.clear();
+        offset_buffer.clear();
+    }
+
+    uint64_t offset(uint64_t ordinal) const {
+        if (ordinal == count) return data_size;
+        if (ordinal >= offsets_flushed) return offset_buffer[ordinal - offsets_flushed];
+        uint64_t value;
+        read_all(offsets_fd, &value, sizeof(value), ordinal * sizeof(uint64_t));
+        return value;
+    }
+
+    // Are the stored bytes of this ordinal equal to material?
+    bool same_bytes(uint64_t ordinal, const std::string& material) {
+        verifications++;
+        uint64_t begin = offset(ordinal), end = offset(ordinal + uint64_t(1));
+        if (end - begin != material.size()) return false;
+        if (begin >= data_flushed)
+            return data_buffer.compare(begin - data_flushed, material.size(), material) == 0;
+        scratch.resize(material.size());
+        read_all(data_fd, &scratch[0], scratch.size(), begin);
+        return scratch == material;
+    }
+
+    size_t home(uint64_t fp) const { return (fp * 0x9e3779b97f4a7c15ULL) >> 16 & mask; }
+
+    void grow() {
+        std::vector<Entry> old;
+        old.swap(table);
+        table.assign(old.size() * 2, Entry{0, 0, 0});
+        mask = table.size() - 1;
+        for (const Entry& e : old) {
+            if (e.fp == 0) continue;
+            size_t i = home(e.fp);
+            while (table[i].fp != 0) i = (i + 1) & mask;
+            table[i] = e;
+        }
+    }
+public:
+    VerifiedStore(const std::string& prefix, size_t expected_keys) {
+        size_t capacity = 1024;
+        while (capacity * 7 / 10 < expected_keys) capacity *= 2;
+        table.assign(capacity, Entry{0, 0, 0});
+        mask = capacity - 1;
+        data_fd = open_scratch(prefix + ".keydata");
+        offsets_fd = open_scratch(prefix + ".keyoffsets");
+    }
+    ~VerifiedStore() {
+        close(data_fd);
+        close(offsets_fd);
+    }
+
+    // material is the byte string that was hashed into fp
+    bool is_unique(const Fingerprint& fp, const std::string& material) {
+        uint64_t key = fp.hi ? fp.hi : 1;
+        size_t i = home(key);
+        for (; table[i].fp != 0; i = (i + 1) & mask) {
+            if (table[i].fp != key) continue;
+            if (same_bytes(table[i].ordinal(), material)) return false;
+            collisions++;
+        }
+        if (count == MAX_KEYS) throw std::runtime_error("Verified backend is limited to 2^40 unique read pairs");
+        if (count + 1 > table.size() * 9 / 10) {
+            grow();
+            for (i = home(key); table[i].fp != 0; i = (i + 1) & mask) {}
+        }
+        table[i] = Entry{key, static_cast<uint32_t>(count), static_cast<uint8_t>(count >> 32)};
+        offset_buffer.push_back(data_size);
+        data_buffer += material;
+        data_size += material.size();
+        count++;
+        if (data_buffer.size() >= BUFFER_BYTES) flush();
+        return true;
+    }
+
+    size_t size() const { return count; }
+    size_t memory_bytes() const { return table.size() * sizeof(Entry); }
+    uint64_t disk_bytes() const { return data_size + count * sizeof(uint64_t); }
+    size_t verification_count() const { return verifications; }
+    size_t collision_count() const { return collisions; }
+};
 
 // --------------------------------------------------
-// SQLite backend
+// External-memory sort backend (exact, sequential I/O)
 // --------------------------------------------------
-class SQLiteStore {
-    sqlite3* db;
+// Pass 1 appends (fingerprint, read ordinal) tuples to a buffer sized
+// from the memory budget; full buffers are sorted and written as runs,
+// keeping only the first occurrence of each key within the run. The runs
+// are then k-way merged (in several rounds if there are too many for one
+// merge) and the first occurrence of each key sets its bit in a
+// keep-bitmap. Pass 2 re-reads the inputs and writes the kept pairs, so
+// the output keeps the input order.
+struct KeyOrdinal {
+    Fingerprint fp;
+    uint64_t ordinal;
+    bool operator<(const KeyOrdinal& o) const {
+        return fp < o.fp || (fp == o.fp && ordinal < o.ordinal);
+    }
+    bool operator>(const KeyOrdinal& o) const { return o < *this; }
+};
+
+class ExternalSortStore {
+    static const size_t MAX_FANIN = 64;
+    std::string tmp_prefix;
+    size_t run_capacity, reader_entries;
+    std::vector<KeyOrdinal> buffer;
+    std::vector<std::string> run_files;
+    size_t run_seq = 0;
+
+    // Buffered sequential reader over one run
+    class RunReader {
+        FILE* f;
+        std::vector<KeyOrdinal> buf;
+        size_t pos = 0, len = 0;
+    public:
+        RunReader(const std::string& file, size_t entries) : buf(entries) {
+            f = fopen(file.c_str(), "rb");
+            if (!f) throw std::runtime_error("Cannot reopen run " + file);
+        }
+        ~RunReader() { fclose(f); }
+        bool next(KeyOrdinal& ko) {
+            if (pos == len) {
+                len = fread(buf.data(), sizeof(KeyOrdinal), buf.size(), f);
+                pos = 0;
+                if (len == 0) return false;
+            }
+            ko = buf[pos++];
+            return true;
+        }
+    };
+
+    std::string new_run_file() { return tmp_prefix + ".sort" + std::to_string(run_seq++); }
+
+    void write_run(const std::string& file, const std::vector<KeyOrdinal>& run) {
+        FILE* f = fopen(file.c_str(), "wb");
+        if (!f || fwrite(run.data(), sizeof(KeyOrdinal), run.size(), f) != run.size() || fclose(f) != 0)
+            throw std::runtime_error("Cannot write run " + file);
+    }
+
+    // Merge the given runs; emit(ko) is called once per key, with its
+    // smallest ordinal, in key order
+    template <typename Emit>
+    void merge(const std::vector<std::string>& files, Emit emit) {
+        std::vector<RunReader*> readers;
+        typedef std::pair<KeyOrdinal, size_t> Head;
+        std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heap;
+        for (const std::string& file : files) {
+            readers.push_back(new RunReader(file, reader_entries));
+            KeyOrdinal ko;
+            if (readers.back()->next(ko)) heap.push(Head(ko, readers.size() - 1));
+        }
+        bool first = true;
+        Fingerprint last{0, 0};
+        while (!heap.empty()) {
+            Head head = heap.top();
+            heap.pop();
+            if (first || head.first.fp != last) {
+                emit(head.first);
+                last = head.first.fp;
+                first = false;
+            }
+            KeyOrdinal ko;
+            if (readers[head.second]->next(ko)) heap.push(Head(ko, head.second));
+        }
+        for (RunReader* reader : readers) delete reader;
+    }
 public:
-    SQLiteStore(const std::string& filename) {
-        if (sqlite3_open(filename.c_str(), &db))
-            throw std::runtime_error("Cannot open SQLite DB");
-        const char* sql = "CREATE TABLE IF NOT EXISTS hashes (hash TEXT PRIMARY KEY);";
-        sqlite3_exec(db, sql, 0, 0, 0);
+    // The keep-bitmap (one bit per read) is charged to the budget first;
+    // the rest holds the run buffer, or the merge buffers later
+    ExternalSortStore(size_t budget, size_t expected_reads, const std::string& prefix)
+        : tmp_prefix(prefix) {
+        const size_t min_entries = 1 << 16;
+        size_t bitmap = (expected_reads + 63) / 64 * 8;
+        size_t rest = budget > bitmap ? budget - bitmap : 0;
+        if (rest / sizeof(KeyOrdinal) < min_entries) {
+            std::cerr << std::fixed << std::setprecision(1) << "Warning: memory budget of " << budget / 1048576.0
+                      << " MB is below the " << (bitmap + min_entries * sizeof(KeyOrdinal)) / 1048576.0
+                      << " MB the external sort "
+                      << "needs (keep-bitmap and a " << min_entries << "-entry run buffer); using that\n";
+        }
+        run_capacity = std::max<size_t>(rest / sizeof(KeyOrdinal), min_entries);
+        reader_entries = std::min<size_t>(std::max<size_t>(rest / (2 * MAX_FANIN * sizeof(KeyOrdinal)), 1024), 1 << 16);
+        buffer.reserve(std::min(run_capacity, expected_reads + 1));
     }
-    ~SQLiteStore() { sqlite3_close(db); }
-    bool is_unique(const std::string& key) {
-        sqlite3_stmt* stmt;
-        const char* insert = "INSERT INTO hashes (hash) VALUES (?);";
-        if (sqlite3_prepare_v2(db, insert, -1, &stmt, 0) != SQLITE_OK)
-            throw std::runtime_error("SQLite prepare failed");
-        sqlite3_bind_text(stmt, 1, key.c_str(), -1, SQLITE_STATIC);
-        bool unique = true;
-        if (sqlite3_step(stmt) != SQLITE_DONE) unique = false;
-        sqlite3_finalize(stmt);
-        return unique;
+    ~ExternalSortStore() {
+        for (const std::string& file : run_files) std::remove(file.c_str());
+    }
+
+    void add(const Fingerprint& fp, uint64_t ordinal) {
+        buffer.push_back(KeyOrdinal{fp, ordinal});
+        if (buffer.size() >= run_capacity) flush();
+    }
+
+    // Sort the buffer and write it as a run of first occurrences
+    void flush() {
+        if (buffer.empty()) return;
+        std::sort(buffer.begin(), buffer.end());
+        auto same_key = [](const KeyOrdinal& a, const KeyOrdinal& b) { return a.fp == b.fp; };
+        buffer.erase(std::unique(buffer.begin(), buffer.end(), same_key), buffer.end());
+        run_files.push_back(new_run_file());
+        write_run(run_files.back(), buffer);
+        buffer.clear();
+    }
+    size_t run_count() const { return run_files.size(); }
+
+    // Merge all runs into a bitmap of the ordinals to keep (n reads).
+    // If keys is given, every kept fingerprint is added to it, in order.
+    std::vector<uint64_t> keep_bitmap(uint64_t n, SnapshotWriter* keys = nullptr) {
+        flush();
+        std::vector<KeyOrdinal>().swap(buffer);
+
+        // Reduce the number of runs to one merge's worth
+        while (run_files.size() > MAX_FANIN) {
+            std::vector<std::string> group(run_files.begin(), run_files.begin() + MAX_FANIN);
+            run_files.erase(run_files.begin(), run_files.begin() + MAX_FANIN);
+            std::string file = new_run_file();
+            FILE* f = fopen(file.c_str(), "wb");
+            if (!f) throw std::runtime_error("Cannot write run " + file);
+            std::vector<KeyOrdinal> out;
+            out.reserve(reader_entries);
+            // A full --tmp-dir shows up here, as ENOSPC
+            auto write_out = [&] {
+                if (fwrite(out.data(), sizeof(KeyOrdinal), out.size(), f) != out.size()) {
+                    int err = errno;
+                    fclose(f);
+                    throw std::runtime_error("Cannot write run " + file + ": " + strerror(err));
+                }
+                out.clear();
+            };
+            merge(group, [&](const KeyOrdinal& ko) {
+                out.push_back(ko);
+                if (out.size() == reader_entries) write_out();
+            });
+            write_out();
+            if (fclose(f) != 0) throw std::runtime_error("Cannot write run " + file + ": " + strerror(errno));
+            for (const std::string& g : group) std::remove(g.c_str());
+            run_files.push_back(file);
+        }
+
+        std::vector<uint64_t> keep((n + 63) / 64, 0);
+        merge(run_files, [&](const KeyOrdinal& ko) {
+            keep[ko.ordinal / 64] |= uint64_t(1) << (ko.ordinal % 64);
+            if (keys) keys->add(ko.fp);
+        });
+        return keep;
     }
 };
 
+// --------------------------------------------------
+// Dedup engine
+// --------------------------------------------------
+// The main loop is a template over the key source (which bytes identify
+// a read pair) and the backend store, instantiated for each combination
+// and picked once in main(). The per-read path has no runtime dispatch,
+// so key building and the backend lookup can be inlined.
+
+// Key sources: build the bytes hashed into the fingerprint of a pair
+
+// Both sequences (also when the barcode is pasted to one of the reads)
+struct SequenceKey {
+    static const bool uses_index = false;
+    static void material(std::string& out, const FastqRecord& r1, const FastqRecord& r2, const FastqRecord&) {
+        out.assign(r1.seq);
+        out += r2.seq;
+    }
+};
+
+// Barcode from the read name, then both sequences
+struct NameKey {
+    static const bool uses_index = false;
+    static void material(std::string& out, const FastqRecord& r1, const FastqRecord& r2, const FastqRecord&) {
+        out.assign(extract_barcode_from_name(r1.id));
+        out += r1.seq;
+        out += r2.seq;
+    }
+};
+
+// Index read sequence, then both sequences
+struct IndexKey {
+    static const bool uses_index = true;
+    static void material(std::string& out, const FastqRecord& r1, const FastqRecord& r2, const FastqRecord& r3) {
+        out.assign(r3.seq);
+        out += r1.seq;
+        out += r2.seq;
+    }
+};
+
+// One chunk of read pairs and their keys; the buffers are reused
+struct Chunk {
+    static const size_t CAPACITY = 4096;
+    std::vector<FastqRecord> r1, r2, r3;
+    std::vector<Fingerprint> keys;
+    std::vector<std::string> material;  // the bytes behind each key
+    std::vector<char> unique;
+    size_t size = 0, first = 0;         // first: ordinal of the first pair
+
+    Chunk() : r1(CAPACITY), r2(CAPACITY), r3(CAPACITY), keys(CAPACITY),
+              material(CAPACITY), unique(CAPACITY) {}
+};
+
+struct DedupRun {
+    gzFile in1, in2, index, out1, out2;
+    const std::vector<SnapshotSet*>* snapshots;
+    size_t total_reads;
+    StageProfile* profile;
+    LatencyRecorder* latency;
+    size_t processed = 0, dup = 0, written = 0, snapshot_hits = 0;
+};
+
+// Backend lookups: clear unique[i] for duplicates. Pairs already found
+// in a snapshot (unique[i] false) are not looked up.
+template <typename Store>
+inline void lookup_chunk(Store& store, Chunk& c, LatencyRecorder& latency) {
+    for (size_t i = 0; i < c.size; i++)
+        if (c.unique[i]) c.unique[i] = latency.time([&] { return store.is_unique(c.keys[i]); });
+}
+
+// Timed per key by the shard threads
+inline void lookup_chunk(ShardedSQLiteStore& store, Chunk& c, LatencyRecorder&) {
+    store.is_unique_batch(c.keys.data(), c.unique.data(), c.size);
+}
+
+inline void lookup_chunk(TwoPassStore& store, Chunk& c, LatencyRecorder& latency) {
+    for (size_t i = 0; i < c.size; i++)
+        if (c.unique[i]) c.unique[i] = latency.time([&] { return store.is_unique(c.keys[i], c.r1[i], c.r2[i]); });
+}
+
+inline void lookup_chunk(ExternalSortStore& store, Chunk& c, LatencyRecorder&) {
+    for (size_t i = 0; i < c.size; i++)
+        if (c.unique[i]) store.add(c.keys[i], c.first + i);
+}
+
+inline void lookup_chunk(QuotientStore& store, Chunk& c, LatencyRecorder& latency) {
+    for (size_t i = 0; i < c.size; i++)
+        if (c.unique[i]) c.unique[i] = latency.time([&] { return store.insert(c.keys[i]) == 0; });
+}
+
+inline void lookup_chunk(VerifiedStore& store, Chunk& c, LatencyRecorder& latency) {
+    for (size_t i = 0; i < c.size; i++)
+        if (c.unique[i]) c.unique[i] = latency.time([&] { return store.is_unique(c.keys[i], c.material[i]); });
+}
+
+// Backends that only decide which pairs to keep after the last chunk
+template <typename Store> struct defers_output { static const bool value = false; };
+template <> struct defers_output<ExternalSortStore> { static const bool value = true; };
+
+template <typename KeySource, typename Store>
+void dedup_loop(DedupRun& run, Store& store) {
+    Chunk c;
+    StageProfile* prof = run.profile;
+    while (true) {
+        size_t n = 0;
+        {
+            StageTimer timer(prof, STAGE_READ);
+            while (n < Chunk::CAPACITY && read_fastq_record(run.in1, c.r1[n]) && read_fastq_record(run.in2, c.r2[n])) {
+                if (KeySource::uses_index) read_fastq_record(run.index, c.r3[n]);
+                n++;
+            }
+            if (profile_enabled) {
+                size_t bytes = 0;
+                for (size_t i = 0; i < n; i++) {
+                    bytes += fastq_record_bytes(c.r1[i]) + fastq_record_bytes(c.r2[i]);
+                    if (KeySource::uses_index) bytes += fastq_record_bytes(c.r3[i]);
+                }
+                prof->add(STAGE_READ, n, bytes);
+            }
+        }
+        if (n == 0) break;
+        c.size = n;
+        c.first = run.processed;
+
+        {
+            StageTimer timer(prof, STAGE_KEY);
+            size_t bytes = 0;
+            for (size_t i = 0; i < n; i++) {
+                KeySource::material(c.material[i], c.r1[i], c.r2[i], c.r3[i]);
+                bytes += c.material[i].size();
+                c.keys[i] = fingerprint(c.material[i]);
+                c.unique[i] = true;
+                for (const SnapshotSet* snap : *run.snapshots) {
+                    if (snap->contains(c.keys[i])) { c.unique[i] = false; run.snapshot_hits++; break; }
+                }
+            }
+            prof->add(STAGE_KEY, n, bytes);
+        }
+
+        {
+            StageTimer timer(prof, STAGE_LOOKUP);
+            lookup_chunk(store, c, *run.latency);
+            prof->add(STAGE_LOOKUP, n, n * sizeof(Fingerprint));
+        }
+
+        if (!defers_output<Store>::value) {
+            StageTimer timer(prof, STAGE_WRITE);
+            size_t kept = 0, bytes = 0;
+            for (size_t i = 0; i < n; i++) {
+                if (c.unique[i]) {
+                    write_fastq_record(run.out1, c.r1[i]);
+                    write_fastq_record(run.out2, c.r2[i]);
+                    if (profile_enabled) bytes += fastq_record_bytes(c.r1[i]) + fastq_record_bytes(c.r2[i]);
+                    kept++;
+                }
+            }
+            run.written += kept;
+            run.dup += n - kept;
+            prof->add(STAGE_WRITE, kept, bytes);
+        }
+
+        size_t before = run.processed;
+        run.processed += n;
+        if (before == 0 && alloc_tracking) mark_alloc_warmup(n);
+        if (run.processed / 100000 != before / 100000) {
+            double pct_processed = (100.0 * run.processed) / run.total_reads;
+            double pct_dup = (100.0 * run.dup) / run.processed;
+            std::cerr << "\rProcessed: " << run.processed << " / " << run.total_reads << " ("
+                << std::fixed << std::setprecision(1) << pct_processed << "%) | "
+                << run.dup << " (" << std::fixed << std::setprecision(1) << pct_dup << "%) duplicates" << std::flush;
+        }
+    }
+}
+
 // --------------------------------------------------
 // Main
 // --------------------------------------------------
-int main(int argc, char* argv[]) {
+// bench.cpp includes this file to reuse its kernels, without main()
+#ifndef DEDUP_NO_MAIN
+
+// Prefix of the temporary files of this run (in --tmp-dir), so they can
+// be removed when the run fails
+std::string temp_prefix;
+
+void remove_temp_files() {
+    if (temp_prefix.empty()) return;
+    std::filesystem::path prefix(temp_prefix);
+    std::string name = prefix.filename().string();
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(prefix.parent_path(), ec))
+        if (entry.path().filename().string().rfind(name, 0) == 0) std::filesystem::remove(entry.path(), ec);
+}
+
+// Errors (bad input or options, full disk, ...) are thrown as exceptions
+// and end the run here with status 1
+int main(int argc, char* argv[]) try {
     std::string read1_file, read2_file, index_file;
     bool barcode_in_name = false;
     std::string backend = "bloom"; // default
+    std::vector<std::string> snapshot_files;
+    std::string save_snapshot_file;
+    std::string tmp_dir = ".";
+    size_t max_memory = 0;  // 0: cgroup limit or physical RAM
+    size_t sqlite_shards = 1;
+    bool sqlite_bloom = false;
+    bool bloom_grow = false;
+    std::string stats_json_file, trace_file;
+    double max_allocs_per_read = -1;  // < 0: no limit
+    auto wall_start = std::chrono::steady_clock::now();
 
     static struct option long_options[] = {
         {"read1", required_argument, 0, 'a'},
@@ -132,11 +2411,33 @@ int main(int argc, char* argv[]) {
         {"use-memory", no_argument, 0, 'm'},
         {"use-bloom", no_argument, 0, 'l'},
         {"use-sqlite", no_argument, 0, 's'},
+        {"use-two-pass", no_argument, 0, 't'},
+        {"use-adaptive", no_argument, 0, 'A'},
+        {"use-extsort", no_argument, 0, 'x'},
+        {"use-mmap-table", no_argument, 0, 'H'},
+        {"use-quotient", no_argument, 0, 'q'},
+        {"use-cuckoo", no_argument, 0, 'k'},
+        {"use-elias-fano", no_argument, 0, 'e'},
+        {"use-verified", no_argument, 0, 'v'},
+        {"sqlite-shards", required_argument, 0, 'S'},
+        {"sqlite-bloom", no_argument, 0, 'B'},
+        {"bloom-grow", no_argument, 0, 'g'},
+        {"profile", no_argument, 0, 'F'},
+        {"perf-counters", no_argument, 0, 'C'},
+        {"trace", required_argument, 0, 'R'},
+        {"latency", no_argument, 0, 'L'},
+        {"alloc-stats", no_argument, 0, 'N'},
+        {"max-allocs-per-read", required_argument, 0, 'X'},
+        {"stats-json", required_argument, 0, 'J'},
+        {"max-memory", required_argument, 0, 'M'},
+        {"tmp-dir", required_argument, 0, 'T'},
+        {"snapshot", required_argument, 0, 'p'},
+        {"save-snapshot", required_argument, 0, 'P'},
         {0, 0, 0, 0}
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "a:b:i:cmls", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "a:b:i:cmlstAxHqkevS:BgFCR:LNX:J:M:T:p:P:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'a': read1_file = optarg; break;
             case 'b': read2_file = optarg; break;
@@ -145,10 +2446,34 @@ int main(int argc, char* argv[]) {
             case 'm': backend = "memory"; break;
             case 'l': backend = "bloom"; break;
             case 's': backend = "sqlite"; break;
+            case 't': backend = "twopass"; break;
+            case 'A': backend = "adaptive"; break;
+            case 'x': backend = "extsort"; break;
+            case 'H': backend = "mmap"; break;
+            case 'q': backend = "quotient"; break;
+            case 'k': backend = "cuckoo"; break;
+            case 'e': backend = "eliasfano"; break;
+            case 'v': backend = "verified"; break;
+            case 'S': sqlite_shards = std::stoul(optarg); break;
+            case 'B': sqlite_bloom = true; break;
+            case 'g': bloom_grow = true; break;
+            case 'F': profile_enabled = true; break;
+            case 'C': profile_enabled = perf_enabled = true; break;
+            case 'R': trace_file = optarg; trace_enabled = true; break;
+            case 'L': latency_enabled = true; break;
+            case 'N': alloc_tracking = true; break;
+            case 'X': max_allocs_per_read = std::stod(optarg); alloc_tracking = true; break;
+            case 'J': stats_json_file = optarg; break;
+            case 'M': max_memory = parse_size(optarg); break;
+            case 'T': tmp_dir = optarg; break;
+            case 'p': snapshot_files.push_back(optarg); break;
+            case 'P': save_snapshot_file = optarg; break;
             default:
                 std::cerr << "Usage: dedup --read1 R1.fq.gz --read2 R2.fq.gz "
                           << "[--index I.fq.gz] [--barcode-in-name] "
-                          << "[--use-memory | --use-bloom | --use-sqlite]\n";
+                          << "[--use-memory | --use-bloom | --use-sqlite | --use-two-pass | --use-adaptive | --use-extsort | --use-mmap-table | --use-quotient | --use-cuckoo | --use-elias-fano | --use-verified] "
+                          << "[--sqlite-shards N] [--sqlite-bloom] [--bloom-grow] [--profile] [--perf-counters] [--trace FILE] [--latency] [--alloc-stats] [--max-allocs-per-read X] [--stats-json FILE] [--max-memory SIZE] [--tmp-dir DIR] "
+                          << "[--snapshot old.snap ...] [--save-snapshot new.snap]\n";
                 return 1;
         }
     }
@@ -157,10 +2482,33 @@ int main(int argc, char* argv[]) {
         std::cerr << "Error: must provide --read1 and --read2\n";
         return 1;
     }
+    if (sqlite_shards < 1) {
+        std::cerr << "Error: --sqlite-shards must be at least 1\n";
+        return 1;
+    }
+    if (!save_snapshot_file.empty() && (backend == "bloom" || backend == "quotient" || backend == "cuckoo" ||
+                                         backend == "eliasfano" || backend == "verified")) {
+        std::cerr << "Error: --save-snapshot requires an exact backend with 128-bit keys "
+                  << "(--use-memory, --use-sqlite, --use-two-pass, --use-adaptive, --use-extsort or --use-mmap-table)\n";
+        return 1;
+    }
+
+    // Fingerprints kept by earlier runs
+    std::vector<SnapshotSet*> snapshots;
+    for (const std::string& file : snapshot_files) {
+        snapshots.push_back(new SnapshotSet(file));
+        std::cerr << "Loaded snapshot " << file << ": " << snapshots.back()->size() << " keys\n";
+    }
 
     // Count reads
+    StageProfile* main_profile = new_stage_profile("main");
     std::cerr << "Counting reads in " << read1_file << "...\n";
-    size_t total_reads = count_fastq_records(read1_file);
+    size_t total_reads;
+    {
+        StageTimer timer(main_profile, STAGE_COUNT);
+        total_reads = count_fastq_records(read1_file);
+        main_profile->add(STAGE_COUNT, total_reads, 0);
+    }
     std::cerr << "Total reads: " << total_reads << "\n";
 
     // Open input and output files
@@ -188,78 +2536,339 @@ int main(int argc, char* argv[]) {
     gzFile out1 = gzopen(out1_name.c_str(), "wb");
     gzFile out2 = gzopen(out2_name.c_str(), "wb");
 
+    temp_prefix = tmp_dir + "/dedup." + std::to_string(getpid());
+
     // Backend init
-    SQLiteStore* sqlite_store = nullptr;
-    bloom_filter* bloom = nullptr;
-    std::unordered_set<std::string> seen;
+    ShardedSQLiteStore* sqlite_store = nullptr;
+    BloomStore* bloom = nullptr;
+    TwoPassStore* two_pass = nullptr;
+    AdaptiveStore* adaptive = nullptr;
+    ExternalSortStore* ext_sort = nullptr;
+    MmapHashStore* mmap_table = nullptr;
+    QuotientStore* quotient = nullptr;
+    CuckooStore* cuckoo = nullptr;
+    EliasFanoStore* elias_fano = nullptr;
+    VerifiedStore* verified = nullptr;
+    MemoryStore* memory = nullptr;
 
-    if (backend == "sqlite") {
-        sqlite_store = new SQLiteStore("dedup.sqlite");
-    } else if (backend == "bloom") {
+    if (backend == "memory") {
+        memory = new MemoryStore();
+    } else if (backend == "adaptive") {
+        size_t budget = backend_memory_budget(max_memory);
+        std::cerr << "Adaptive backend: memory budget " << (budget >> 20) << " MB\n";
+        adaptive = new AdaptiveStore(budget, temp_prefix);
+    } else if (backend == "extsort") {
+        ext_sort = new ExternalSortStore(backend_memory_budget(max_memory), total_reads, temp_prefix);
+    } else if (backend == "mmap") {
+        mmap_table = new MmapHashStore(temp_prefix + ".table", total_reads);
+        std::cerr << "Hash table file: " << (mmap_table->file_bytes() >> 20) << " MB in " << tmp_dir << "\n";
+    } else if (backend == "quotient") {
+        // 10 remainder bits: ~0.1% false positives, as for the Bloom filter
+        quotient = new QuotientStore(total_reads, 10);
+    } else if (backend == "cuckoo") {
+        cuckoo = new CuckooStore(total_reads);
+    } else if (backend == "eliasfano") {
+        elias_fano = new EliasFanoStore();
+    } else if (backend == "verified") {
+        verified = new VerifiedStore(temp_prefix, total_reads);
+    } else if (backend == "sqlite") {
+        sqlite_store = new ShardedSQLiteStore(sqlite_shards, temp_prefix,
+                                              sqlite_bloom ? total_reads : 0);
+    } else if (backend == "bloom" || backend == "twopass") {
         bloom_parameters params;
         params.projected_element_count = static_cast<uint64_t>(total_reads);
         params.false_positive_probability = 0.001;
         params.compute_optimal_parameters();
-        bloom = new bloom_filter(params);
+        if (backend == "bloom") {
+            bloom = new BloomStore(total_reads, params.false_positive_probability, bloom_grow);
+        } else {
+            two_pass = new TwoPassStore(params, temp_prefix);
+        }
     }
 
-    // Process FASTQ pairs
-    FastqRecord r1, r2, r3;
-    size_t processed = 0, dup = 0, written = 0;
+    // Process FASTQ pairs, one chunk at a time. The key source and the
+    // backend are chosen here once; each combination is its own loop.
+    DedupRun run{f1, f2, f3, out1, out2, &snapshots, total_reads, main_profile,
+                 new_latency_recorder("main")};
+    auto dedup_with = [&](auto key_source) {
+        using KeySource = decltype(key_source);
+        if (memory) dedup_loop<KeySource>(run, *memory);
+        else if (bloom) dedup_loop<KeySource>(run, *bloom);
+        else if (sqlite_store) dedup_loop<KeySource>(run, *sqlite_store);
+        else if (two_pass) dedup_loop<KeySource>(run, *two_pass);
+        else if (adaptive) dedup_loop<KeySource>(run, *adaptive);
+        else if (ext_sort) dedup_loop<KeySource>(run, *ext_sort);
+        else if (mmap_table) dedup_loop<KeySource>(run, *mmap_table);
+        else if (quotient) dedup_loop<KeySource>(run, *quotient);
+        else if (cuckoo) dedup_loop<KeySource>(run, *cuckoo);
+        else if (elias_fano) dedup_loop<KeySource>(run, *elias_fano);
+        else if (verified) dedup_loop<KeySource>(run, *verified);
+    };
+    if (f3) dedup_with(IndexKey());
+    else if (barcode_in_name) dedup_with(NameKey());
+    else dedup_with(SequenceKey());
 
-    while (read_fastq_record(f1, r1) && read_fastq_record(f2, r2)) {
-        std::string key;
-        if (barcode_in_name) {
-            std::string barcode = extract_barcode_from_name(r1.id);
-            key = sha256(barcode + r1.seq + r2.seq);
-        } if (!index_file.empty()) {
-            read_fastq_record(f3, r3);
-            key = sha256(r3.seq + r1.seq + r2.seq);
-        }
-        else {
-            key = sha256(r1.seq + r2.seq);
+    // The passes below may still move read pairs between written and dup
+    size_t processed = run.processed, dup = run.dup, written = run.written;
+
+    if (two_pass) {
+        std::cerr << "\nPass 2: checking " << two_pass->candidate_count()
+                  << " candidate duplicate keys...\n";
+        size_t rescued;
+        {
+            StageTimer timer(main_profile, STAGE_LOOKUP);
+            rescued = two_pass->resolve(out1, out2);
         }
+        written += rescued;
+        dup -= rescued;
+        std::cerr << "Recovered " << rescued << " Bloom false positives\n";
+    }
 
-        bool unique = true;
-        if (backend == "memory") {
-            if (seen.count(key)) unique = false;
-            else seen.insert(key);
-        } else if (backend == "sqlite") {
-            unique = sqlite_store->is_unique(key);
-        } else if (backend == "bloom") {
-            if (bloom->contains(key)) unique = false;
-            else bloom->insert(key);
-        }
-
-        if (unique) {
-            write_fastq_record(out1, r1);
-            write_fastq_record(out2, r2);
-            written++;
-        } else {
-            dup++;
+    bool snapshot_saved = false;
+    if (ext_sort) {
+        std::cerr << "\nMerging " << ext_sort->run_count() << " sorted runs...\n";
+        // Without previous snapshots the merged keys are the snapshot;
+        // otherwise they go through a temporary one first
+        std::string keys_file = snapshots.empty() ? save_snapshot_file : temp_prefix + ".keys";
+        SnapshotWriter* keys = save_snapshot_file.empty() ? nullptr : new SnapshotWriter(keys_file, processed);
+        std::vector<uint64_t> keep;
+        {
+            StageTimer timer(main_profile, STAGE_LOOKUP);
+            keep = ext_sort->keep_bitmap(processed, keys);
+        }
+        if (keys) {
+            keys->finish();
+            delete keys;
+            if (!snapshots.empty()) {
+                SnapshotSet merged(keys_file);
+                std::vector<SnapshotSet*> inputs(snapshots);
+                inputs.push_back(&merged);
+                std::vector<Fingerprint> none;
+                write_snapshot(save_snapshot_file, none, inputs);
+                std::remove(keys_file.c_str());
+            }
+            snapshot_saved = true;
         }
 
-        processed++;
-        if (processed % 100000 == 0) {
-            double pct_processed = (100.0 * processed) / total_reads;
-            double pct_dup = (100.0 * dup) / processed;
-            std::cerr << "\rProcessed: " << processed << " / " << total_reads << " (" 
-                << std::fixed << std::setprecision(1) << pct_processed << "%) | " 
-                << dup << " (" << std::fixed << std::setprecision(1) << pct_dup << "%) duplicates" << std::flush;
+        std::cerr << "Pass 2: writing unique read pairs...\n";
+        StageTimer timer(main_profile, STAGE_WRITE);  // includes reading the inputs again
+        FastqRecord r1, r2;
+        gzrewind(f1);
+        gzrewind(f2);
+        for (size_t i = 0; i < processed && read_fastq_record(f1, r1) && read_fastq_record(f2, r2); i++) {
+            if (keep[i / 64] >> (i % 64) & 1) {
+                write_fastq_record(out1, r1);
+                write_fastq_record(out2, r2);
+                written++;
+            }
         }
+        dup = processed - written;
+        main_profile->add(STAGE_WRITE, written, 0);
     }
 
     // Cleanup
     gzclose(f1); gzclose(f2);
     if (f3) gzclose(f3);
     gzclose(out1); gzclose(out2);
+
+    // Backend statistics for --stats-json; most are also printed below
+    JsonObject backend_stats;
+    if (memory) {
+        backend_stats.add("keys", uint64_t(memory->size())).add("load_factor", memory->load_factor())
+                     .add("memory_bytes", uint64_t(memory->memory_bytes()));
+    }
+    if (mmap_table) {
+        backend_stats.add("keys", uint64_t(mmap_table->size())).add("load_factor", mmap_table->load())
+                     .add("file_bytes", uint64_t(mmap_table->file_bytes()));
+    }
+    if (two_pass) backend_stats.add("candidates", uint64_t(two_pass->candidate_count()));
+    if (ext_sort) backend_stats.add("runs", uint64_t(ext_sort->run_count()));
+
+    if (bloom) {
+        bloom->refresh();
+        backend_stats.add("memory_bytes", uint64_t(bloom->memory_bytes()))
+                     .add("filters", uint64_t(bloom->filter_count())).add("fill_ratio", bloom->fill())
+                     .add("fpp_measured", bloom->fpp()).add("fpp_effective", bloom->effective_fpp())
+                     .add("fpp_target", bloom->target());
+        std::cerr << "\nBloom filter: " << (bloom->memory_bytes() >> 20) << " MB in "
+                  << bloom->filter_count() << " filter(s), fill ratio " << std::setprecision(3)
+                  << bloom->fill() << ", measured FPP " << std::scientific << std::setprecision(2)
+                  << bloom->fpp() << " (target " << bloom->target() << ")"
+                  << std::fixed << std::setprecision(1);
+    }
+    if (quotient) {
+        backend_stats.add("keys", quotient->size()).add("memory_bytes", uint64_t(quotient->memory_bytes()))
+                     .add("load_factor", quotient->load()).add("fpp_estimated", quotient->fpp())
+                     .add("filters", uint64_t(quotient->filter_count()));
+        std::cerr << "\nQuotient filter: " << quotient->size() << " keys, "
+                  << (quotient->memory_bytes() >> 20) << " MB, load "
+                  << std::setprecision(2) << quotient->load() << ", estimated FPP "
+                  << std::scientific << quotient->fpp() << std::fixed << std::setprecision(1)
+                  << ", " << quotient->filter_count() << " filter(s)\n";
+        // Copies per distinct key; the last bucket holds saturated counts
+        std::vector<uint64_t> hist(32, 0);
+        quotient->for_each_count([&](uint64_t count) { hist[count]++; });
+        std::cerr << "Duplicate multiplicity (copies: keys):";
+        for (size_t c = 1; c < hist.size(); c++) {
+            if (hist[c]) std::cerr << " " << c << (c + 1 == hist.size() ? "+" : "") << ":" << hist[c];
+        }
+    }
+    if (cuckoo) {
+        backend_stats.add("memory_bytes", uint64_t(cuckoo->memory_bytes()))
+                     .add("filters", uint64_t(cuckoo->filter_count())).add("fpp_estimated", cuckoo->fpp());
+        std::cerr << "\nCuckoo filter: " << (cuckoo->memory_bytes() >> 20) << " MB in "
+                  << cuckoo->filter_count() << " filter(s), estimated FPP "
+                  << std::scientific << std::setprecision(2) << cuckoo->fpp()
+                  << std::fixed << std::setprecision(1);
+    }
+    if (elias_fano) {
+        backend_stats.add("keys", elias_fano->size()).add("blocks", uint64_t(elias_fano->block_count()))
+                     .add("memory_bytes", uint64_t(elias_fano->memory_bytes()))
+                     .add("compressed_bytes", uint64_t(elias_fano->compressed_bytes()));
+        std::cerr << "\nElias-Fano backend: " << elias_fano->size() << " keys, "
+                  << elias_fano->block_count() << " blocks, "
+                  << (elias_fano->memory_bytes() >> 20) << " MB ("
+                  << (elias_fano->size() ? 8.0 * elias_fano->compressed_bytes() / elias_fano->size() : 0.0)
+                  << " bits/key compressed)";
+    }
+    if (verified) {
+        backend_stats.add("keys", uint64_t(verified->size()))
+                     .add("memory_bytes", uint64_t(verified->memory_bytes()))
+                     .add("disk_bytes", verified->disk_bytes())
+                     .add("verifications", uint64_t(verified->verification_count()))
+                     .add("collisions", uint64_t(verified->collision_count()));
+        std::cerr << "\nVerified backend: " << verified->size() << " keys, "
+                  << (verified->memory_bytes() >> 20) << " MB in memory, "
+                  << (verified->disk_bytes() >> 20) << " MB of key bytes on disk, "
+                  << verified->verification_count() << " byte comparisons, "
+                  << verified->collision_count() << " fingerprint collisions";
+    }
+    if (sqlite_store) backend_stats.add("shards", uint64_t(sqlite_shards));
+    if (sqlite_store && sqlite_bloom) {
+        backend_stats.add("disk_probes", uint64_t(sqlite_store->disk_probes()));
+        std::cerr << "\nSQLite backend: " << sqlite_store->disk_probes()
+                  << " Bloom positives checked on disk";
+    }
+    if (adaptive) {
+        backend_stats.add("memory_keys", uint64_t(adaptive->memory_keys()))
+                     .add("memory_bytes", uint64_t(adaptive->memory_bytes()))
+                     .add("disk_keys", uint64_t(adaptive->disk_keys()))
+                     .add("spills", uint64_t(adaptive->spill_count()));
+        std::cerr << "\nAdaptive backend: " << adaptive->memory_keys() << " keys in memory ("
+                  << (adaptive->memory_bytes() >> 20) << " MB), " << adaptive->disk_keys()
+                  << " keys on disk after " << adaptive->spill_count() << " spills";
+    }
+
+    if (snapshot_saved) {
+        std::cerr << "Saved snapshot " << save_snapshot_file << "\n";
+    } else if (!save_snapshot_file.empty() && adaptive) {
+        adaptive->save_snapshot(save_snapshot_file, snapshots);
+        std::cerr << "\nSaved snapshot " << save_snapshot_file << "\n";
+    } else if (!save_snapshot_file.empty()) {
+        std::vector<Fingerprint> kept;
+        if (backend == "memory") {
+            memory->dump(kept);
+        } else if (backend == "twopass") {
+            two_pass->dump(kept);
+        } else if (backend == "mmap") {
+            mmap_table->dump(kept);
+        } else {
+            sqlite_store->dump(kept);
+        }
+        write_snapshot(save_snapshot_file, kept, snapshots);
+        std::cerr << "\nSaved snapshot " << save_snapshot_file << "\n";
+    }
+
+    delete memory;
     delete sqlite_store;
     delete bloom;
+    delete two_pass;
+    delete adaptive;
+    delete ext_sort;
+    delete mmap_table;
+    delete quotient;
+    delete cuckoo;
+    delete elias_fano;
+    delete verified;
+    for (SnapshotSet* snap : snapshots) delete snap;
 
     std::cerr << "\nDone.\n";
     std::cerr << "Processed: " << processed << " read pairs\n";
     std::cerr << "Written:   " << written << " unique read pairs\n";
     std::cerr << "Duplicates: " << dup << " (" << (100.0 * dup / processed) << "%)\n";
+    if (!snapshots.empty())
+        std::cerr << "  of which already in snapshots: " << run.snapshot_hits << "\n";
+    if (profile_enabled) print_stage_profiles();
+    if (latency_enabled) print_latency_histograms();
+    if (alloc_tracking) print_alloc_stats(processed);
+    if (trace_enabled && !write_trace(trace_file)) {
+        std::cerr << "Error: cannot write " << trace_file << "\n";
+        return 1;
+    }
+
+    if (!stats_json_file.empty()) {
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+
+        std::string inputs = "[";
+        for (const std::string& file : {read1_file, read2_file, index_file}) {
+            if (file.empty()) continue;
+            struct stat st;
+            uint64_t bytes = stat(file.c_str(), &st) == 0 ? st.st_size : 0;
+            JsonObject input;
+            input.add("file", file).add("bytes", bytes).add("mb_per_s", bytes / wall / 1e6)
+                 .add("reads_per_s", processed / wall);
+            inputs += (inputs.size() > 1 ? ", " : "") + input.str();
+        }
+        inputs += "]";
+
+        JsonObject reads, time, mem, report;
+        reads.add("processed", uint64_t(processed)).add("written", uint64_t(written))
+             .add("duplicates", uint64_t(dup)).add("snapshot_hits", uint64_t(run.snapshot_hits));
+        time.add("wall_s", wall)
+            .add("cpu_user_s", usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6)
+            .add("cpu_sys_s", usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6);
+        mem.add("peak_rss_bytes", uint64_t(usage.ru_maxrss) * 1024);  // ru_maxrss is in KB on Linux
+        report.add("backend", backend).add("simd", SIMD_NAMES[simd_level()]).add_raw("inputs", inputs).add("reads", reads).add("time", time)
+              .add("memory", mem).add("backend_stats", backend_stats);
+        if (profile_enabled) report.add_raw("stages", stage_profiles_json());
+        if (latency_enabled) report.add_raw("latency", latency_json());
+        if (alloc_tracking) {
+            JsonObject allocs;
+            allocs.add("allocs_per_pair", allocs_per_pair(processed))
+                  .add("steady_allocs", steady_allocs())
+                  .add("steady_allocs_per_pair", steady_allocs_per_pair(processed));
+            for (const StageProfile& p : stage_profiles) {
+                for (int s = 0; s < NUM_STAGES; s++) {
+                    if (p.allocs[s] == 0) continue;
+                    allocs.add(p.thread + "/" + STAGE_NAMES[s], p.allocs[s]);
+                }
+            }
+            report.add("allocations", allocs);
+        }
+
+        std::ofstream out(stats_json_file);
+        out << report.str() << "\n";
+        if (!out) {
+            std::cerr << "Error: cannot write " << stats_json_file << "\n";
+            return 1;
+        }
+    }
+
+    // Guard for benchmarks: fail when the main loop allocates more than allowed
+    if (max_allocs_per_read >= 0 && steady_allocs_per_pair(processed) > max_allocs_per_read) {
+        uint64_t pairs = processed > warmup_pairs ? processed - warmup_pairs : 0;
+        std::cerr << "Error: " << steady_allocs() << " allocations in the main loop for the " << pairs
+                  << " read pairs after the first chunk, above --max-allocs-per-read " << std::defaultfloat
+                  << max_allocs_per_read << " (" << uint64_t(max_allocs_per_read * pairs) << " allowed)\n";
+        return 2;
+    }
 
     return 0;
+} catch (const std::exception& e) {
+    std::cerr << "\nError: " << e.what() << "\n";
+    remove_temp_files();
+    return 1;
 }
+#endif
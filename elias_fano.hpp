@@ -0,0 +1,155 @@
+// elias_fano.hpp
+
+// Elias-Fano encoding of a sorted sequence of distinct integers below
+// 2^universe_bits (Elias 1974, Fano 1971; see also Vigna, "Quasi-succinct
+// indices", WSDM 2013).
+
+// Each value is split into its l low bits, stored verbatim in a packed
+// array, and its high bits, stored in unary in a bitvector: value i sets
+// bit (high_i + i). With l = universe_bits - floor(log2 n) the bitvector
+// has at most 3n bits, so a sequence takes about l + 2 bits per value,
+// e.g. ~35 bits for 2^31 64-bit hashes.
+
+// A membership query finds the first value with the query's high bits
+// through a sampled select0 on the bitvector (one sample every 256
+// zeros, then popcounts), then compares the few low parts of that bucket.
+
+#ifndef INCLUDE_ELIAS_FANO_HPP
+#define INCLUDE_ELIAS_FANO_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+class EliasFano {
+public:
+    // Empty sequence of n values; fill it with push_back() in increasing
+    // order, exactly n times
+    EliasFano(uint64_t n, unsigned universe_bits = 64) : count(n), ubits(universe_bits) {
+        if (universe_bits < 1 || universe_bits > 64) throw std::runtime_error("Bad Elias-Fano universe");
+        unsigned log_n = 0;
+        while (log_n < 63 && (uint64_t(2) << log_n) <= n) log_n++;
+        lbits = (n == 0 || log_n >= ubits) ? 0 : ubits - 1 - log_n;
+        uint64_t high_max = (ubits - lbits >= 64) ? ~uint64_t(0) : (uint64_t(1) << (ubits - lbits)) - 1;
+        uint64_t upper_bits = n + (n == 0 ? 0 : std::min<uint64_t>(high_max, 2 * n + 2)) + 1;
+        upper.assign(upper_bits / 64 + 2, 0);
+        lower.assign((n * lbits) / 64 + 2, 0);
+    }
+
+    void push_back(uint64_t value) {
+        if (pushed == count) throw std::runtime_error("Elias-Fano sequence overflow");
+        uint64_t high = value >> lbits;
+        uint64_t pos = high + pushed;
+        if (pos / 64 >= upper.size() - 1) throw std::runtime_error("Elias-Fano value out of range");
+        upper[pos / 64] |= uint64_t(1) << (pos % 64);
+        if (lbits) set_low(pushed, value & low_mask());
+        upper_end = pos + 1;
+        pushed++;
+        if (pushed == count) build_samples();
+    }
+
+    bool contains(uint64_t value) const {
+        if (count == 0) return false;
+        uint64_t high = value >> lbits, low = value & low_mask();
+        if (high > zeros) return false;
+        // Values with this high part are the ones after zero number high-1
+        uint64_t pos = high == 0 ? 0 : select0(high - 1) + 1;
+        uint64_t index = pos - high;
+        while (pos < upper_end && (upper[pos / 64] >> (pos % 64) & 1)) {
+            uint64_t l = lbits ? get_low(index) : 0;
+            if (l == low) return true;
+            if (l > low) return false;
+            pos++;
+            index++;
+        }
+        return false;
+    }
+
+    uint64_t size() const { return count; }
+    size_t memory_bytes() const {
+        return (upper.size() + lower.size() + samples.size()) * sizeof(uint64_t);
+    }
+
+    // Sequential decoder
+    class Iterator {
+        const EliasFano* ef;
+        uint64_t index = 0, pos = 0;
+    public:
+        explicit Iterator(const EliasFano* seq) : ef(seq) {}
+        bool next(uint64_t& value) {
+            if (index == ef->count) return false;
+            while (!(ef->upper[pos / 64] >> (pos % 64) & 1)) pos++;
+            uint64_t high = pos - index;
+            value = (high << ef->lbits) | (ef->lbits ? ef->get_low(index) : 0);
+            pos++;
+            index++;
+            return true;
+        }
+    };
+
+private:
+    static const uint64_t SAMPLE_RATE = 256;
+
+    uint64_t count, pushed = 0, upper_end = 0, zeros = 0;
+    unsigned ubits, lbits;
+    std::vector<uint64_t> upper, lower;
+    std::vector<uint64_t> samples;  // position of zero number k * SAMPLE_RATE
+
+    uint64_t low_mask() const { return lbits == 64 ? ~uint64_t(0) : (uint64_t(1) << lbits) - 1; }
+
+    uint64_t get_low(uint64_t i) const {
+        uint64_t bit = i * lbits, word = bit / 64, off = bit % 64;
+        uint64_t v = lower[word] >> off;
+        if (off + lbits > 64) v |= lower[word + 1] << (64 - off);
+        return v & low_mask();
+    }
+
+    void set_low(uint64_t i, uint64_t v) {
+        uint64_t bit = i * lbits, word = bit / 64, off = bit % 64;
+        lower[word] |= v << off;
+        if (off + lbits > 64) lower[word + 1] |= v >> (64 - off);
+    }
+
+    // Zeros are only counted up to the last value, so queries above the
+    // largest high part stop early
+    void build_samples() {
+        uint64_t seen = 0;  // zeros before word w
+        for (uint64_t w = 0; w * 64 < upper_end; w++) {
+            uint64_t bits = ~upper[w];
+            if ((w + 1) * 64 > upper_end) bits &= (uint64_t(1) << (upper_end % 64)) - 1;
+            uint64_t n = __builtin_popcountll(bits);
+            uint64_t k = (seen + SAMPLE_RATE - 1) / SAMPLE_RATE * SAMPLE_RATE;
+            for (; k < seen + n; k += SAMPLE_RATE)
+                samples.push_back(w * 64 + select_in_word(bits, k - seen));
+            seen += n;
+        }
+        zeros = seen;
+    }
+
+    // Position of the k-th (0-based) set bit of x
+    static unsigned select_in_word(uint64_t x, uint64_t k) {
+        for (uint64_t i = 0; i < k; i++) x &= x - 1;
+        return __builtin_ctzll(x);
+    }
+
+    // Position of zero number k in the upper bitvector (k < zeros)
+    uint64_t select0(uint64_t k) const {
+        uint64_t pos = samples[k / SAMPLE_RATE];
+        uint64_t left = k % SAMPLE_RATE;
+        if (left == 0) return pos;
+        // Zeros strictly after pos in its word
+        uint64_t w = pos / 64;
+        uint64_t bits = ~upper[w] & ~((uint64_t(2) << (pos % 64)) - 1);
+        if (pos % 64 == 63) bits = 0;
+        while (true) {
+            uint64_t n = __builtin_popcountll(bits);
+            if (left <= n) return w * 64 + select_in_word(bits, left - 1);
+            left -= n;
+            bits = ~upper[++w];
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,569 @@
+// gen_fastq.cpp
+
+// Writes synthetic paired-end FASTQ files with a known duplication
+// profile, for benchmarks and accuracy checks of dedup that can be shared
+// (no patient data).
+
+// Each molecule is a random fragment, sequenced as one or more read pairs
+// (its family). Family sizes follow a geometric, Poisson or Zipf
+// distribution whose mean gives the requested duplicate rate, and the
+// copies of a molecule are spread at random over the next --spread pairs
+// of the file. Every read gets its own substitution errors, so a copy is
+// only a duplicate for dedup when its errors are the same as those of an
+// earlier copy (usually: none).
+
+// Ground truth: the name of each read gives its molecule, its copy number
+// and whether dedup should keep it ('u') or drop it ('d'), and
+// <prefix>_truth.txt has the totals and the family size histogram.
+
+// Usage: gen_fastq --pairs 10M [--length 150] [--dup-rate 0.3] ...
+//        (gen_fastq --help for all options)
+
+
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <queue>
+#include <deque>
+#include <map>
+#include <unordered_set>
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <stdexcept>
+#include <zlib.h>
+#include <getopt.h>
+
+// --------------------------------------------------
+// Random numbers
+// --------------------------------------------------
+// splitmix64: fast, and seeded per molecule and per read, so any read can
+// be rebuilt from (seed, molecule, copy) alone
+uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+struct Rng {
+    typedef uint64_t result_type;
+    uint64_t state;
+    explicit Rng(uint64_t seed) : state(mix64(seed)) {}
+    static constexpr uint64_t min() { return 0; }
+    static constexpr uint64_t max() { return ~uint64_t(0); }
+    uint64_t operator()() { return mix64(state += 0x9e3779b97f4a7c15ULL); }
+    double uniform() { return ((*this)() >> 11) * 0x1.0p-53; }  // [0, 1)
+};
+
+// --------------------------------------------------
+// Parallel gzip output
+// --------------------------------------------------
+// Blocks of FASTQ text are compressed by a pool of threads into separate
+// gzip members, written in order. A file of concatenated members is a
+// valid gzip file (zlib, gzip and dedup read it as one stream), and the
+// output does not depend on the number of threads.
+class GzipPool {
+public:
+    GzipPool(unsigned threads, int level) : level(level) {
+        for (unsigned i = 0; i < std::max(1u, threads); i++) workers.emplace_back([this] { work(); });
+        max_in_flight = 4 * workers.size();
+    }
+
+    ~GzipPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        todo_cv.notify_all();
+        for (std::thread& t : workers) t.join();
+    }
+
+    // Output file; the pool writes to it until close()
+    size_t open(const std::string& path) {
+        FILE* f = std::fopen(path.c_str(), "wb");
+        if (!f) throw std::runtime_error("Cannot create " + path);
+        files.push_back(std::unique_ptr<File>(new File{f, path, {}}));
+        return files.size() - 1;
+    }
+
+    // Queues data (taken over) for compression to file `id`
+    void submit(size_t id, std::string& data) {
+        std::shared_ptr<Job> job(new Job);
+        job->in.swap(data);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            todo.push_back(job);
+            files[id]->pending.push_back(job);
+            in_flight++;
+        }
+        todo_cv.notify_one();
+        write_ready(max_in_flight);
+    }
+
+    // Writes everything queued, then closes all files
+    void close() {
+        write_ready(0);
+        for (std::unique_ptr<File>& f : files) {
+            if (std::fclose(f->out) != 0) throw std::runtime_error("Error writing " + f->path);
+        }
+        files.clear();
+    }
+
+private:
+    struct Job {
+        std::string in, out;
+        bool done = false;
+    };
+    struct File {
+        FILE* out;
+        std::string path;
+        std::deque<std::shared_ptr<Job>> pending;  // in file order
+    };
+
+    int level;
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<File>> files;
+    std::deque<std::shared_ptr<Job>> todo;
+    std::mutex mutex;
+    std::condition_variable todo_cv, done_cv;
+    size_t in_flight = 0, max_in_flight;
+    bool stopping = false;
+
+    void work() {
+        while (true) {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                todo_cv.wait(lock, [this] { return stopping || !todo.empty(); });
+                if (todo.empty()) return;
+                job = todo.front();
+                todo.pop_front();
+            }
+            compress(*job);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                job->done = true;
+            }
+            done_cv.notify_all();
+        }
+    }
+
+    void compress(Job& job) {
+        z_stream zs = {};
+        if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("deflateInit2 failed");
+        job.out.resize(deflateBound(&zs, job.in.size()));
+        zs.next_in = reinterpret_cast<Bytef*>(&job.in[0]);
+        zs.avail_in = job.in.size();
+        zs.next_out = reinterpret_cast<Bytef*>(&job.out[0]);
+        zs.avail_out = job.out.size();
+        if (deflate(&zs, Z_FINISH) != Z_STREAM_END) throw std::runtime_error("deflate failed");
+        job.out.resize(zs.total_out);
+        deflateEnd(&zs);
+        std::string().swap(job.in);
+    }
+
+    // Writes the finished blocks at the head of each file, waiting until
+    // at most `limit` blocks are left in flight
+    void write_ready(size_t limit) {
+        while (true) {
+            std::vector<std::pair<File*, std::shared_ptr<Job>>> ready;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                for (std::unique_ptr<File>& f : files) {
+                    while (!f->pending.empty() && f->pending.front()->done) {
+                        ready.emplace_back(f.get(), f->pending.front());
+                        f->pending.pop_front();
+                        in_flight--;
+                    }
+                }
+                if (ready.empty()) {
+                    if (in_flight <= limit) return;
+                    done_cv.wait(lock);
+                    continue;
+                }
+            }
+            for (auto& r : ready) {
+                const std::string& out = r.second->out;
+                if (std::fwrite(out.data(), 1, out.size(), r.first->out) != out.size())
+                    throw std::runtime_error("Error writing " + r.first->path);
+            }
+        }
+    }
+};
+
+// --------------------------------------------------
+// Family sizes
+// --------------------------------------------------
+// Number of read pairs per molecule, with mean 1 / (1 - dup_rate) so that
+// a fraction dup_rate of the pairs are copies of an earlier one
+class FamilySizes {
+public:
+    static const uint64_t ZIPF_MAX = 100000;
+
+    FamilySizes(const std::string& dist, double dup_rate) : kind(dist), rate(dup_rate) {
+        double mean = 1.0 / (1.0 - dup_rate);
+        if (dist == "geometric") {
+            geometric = std::geometric_distribution<uint64_t>(1.0 - dup_rate);
+        } else if (dist == "poisson") {
+            if (dup_rate > 0) poisson = std::poisson_distribution<uint64_t>(mean - 1.0);
+        } else if (dist == "zipf") {
+            // P(k) ~ k^-s for 1 <= k <= ZIPF_MAX; the mean falls as s
+            // grows, so s is found by bisection
+            double lo = 1.0, hi = 60.0;
+            for (int i = 0; i < 60; i++) {
+                double s = (lo + hi) / 2;
+                if (zipf_mean(s) > mean) lo = s;
+                else hi = s;
+            }
+            exponent = (lo + hi) / 2;
+            cdf.resize(ZIPF_MAX);
+            double sum = 0;
+            for (uint64_t k = 1; k <= ZIPF_MAX; k++) cdf[k - 1] = sum += std::pow(double(k), -exponent);
+            for (double& c : cdf) c /= sum;
+        } else {
+            throw std::runtime_error("Unknown family size distribution: " + dist);
+        }
+    }
+
+    uint64_t operator()(Rng& rng) {
+        if (rate == 0) return 1;
+        if (kind == "geometric") return 1 + geometric(rng);
+        if (kind == "poisson") return 1 + poisson(rng);
+        return std::lower_bound(cdf.begin(), cdf.end(), rng.uniform()) - cdf.begin() + 1;
+    }
+
+    std::string describe() const {
+        if (kind != "zipf") return kind;
+        return "zipf (s = " + std::to_string(exponent) + ", max " + std::to_string(ZIPF_MAX) + ")";
+    }
+
+private:
+    std::string kind;
+    double rate, exponent = 0;
+    std::geometric_distribution<uint64_t> geometric;
+    std::poisson_distribution<uint64_t> poisson;
+    std::vector<double> cdf;
+
+    static double zipf_mean(double s) {
+        double sum = 0, weighted = 0;
+        for (uint64_t k = 1; k <= ZIPF_MAX; k++) {
+            double p = std::pow(double(k), -s);
+            sum += p;
+            weighted += k * p;
+        }
+        return weighted / sum;
+    }
+};
+
+// --------------------------------------------------
+// Reads
+// --------------------------------------------------
+struct Params {
+    uint64_t pairs = 1000000;
+    unsigned length = 150, umi_length = 8;
+    double dup_rate = 0.3, error_rate = 0.001;
+    std::string families = "geometric";
+    uint64_t spread = 100000000;
+    bool index = false, barcode_in_name = false;
+    uint64_t seed = 1;
+};
+
+const char BASES[] = "ACGT";
+// Binned qualities as on recent Illumina instruments, mostly 'F'
+const char QUALITIES[] = "FFFFFFFFFFFF::,,";
+
+// Molecule sequence: R1, then R2, then the UMI, as base codes 0-3
+void molecule_bases(const Params& p, uint64_t mol, std::vector<uint8_t>& bases) {
+    Rng rng(p.seed * 0x2545f4914f6cdd1dULL ^ mol);
+    bases.resize(2 * p.length + p.umi_length);
+    for (size_t i = 0; i < bases.size(); i += 32) {
+        uint64_t x = rng();
+        for (size_t j = i; j < std::min(bases.size(), i + 32); j++, x >>= 2) bases[j] = x & 3;
+    }
+}
+
+// Calls f(position, shift) for each substitution of read `copy` of
+// molecule `mol`: the base at position becomes (base + shift) % 4. Gaps
+// between errors are geometric, so this costs one draw per error.
+template <typename F>
+void for_each_error(const Params& p, uint64_t mol, uint64_t copy, F f) {
+    if (p.error_rate <= 0) return;
+    Rng rng(mix64(p.seed ^ mol) + copy);
+    double log_q = std::log1p(-p.error_rate);
+    uint64_t n = 2 * p.length + p.umi_length;
+    uint64_t pos = 0;
+    while (true) {
+        double gap = std::floor(std::log(1.0 - rng.uniform()) / log_q);
+        if (gap >= double(n - pos)) return;
+        pos += uint64_t(gap);
+        f(pos, 1 + rng() % 3);
+        pos++;
+    }
+}
+
+// Identifies the errors of a read: reads with the same signature have the
+// same sequences (0: no errors)
+uint64_t error_signature(const Params& p, uint64_t mol, uint64_t copy) {
+    uint64_t sig = 0;
+    for_each_error(p, mol, copy, [&](uint64_t pos, unsigned shift) { sig = mix64(sig + pos * 4 + shift); });
+    return sig;
+}
+
+void append_record(std::string& out, const std::string& name, const char* mate,
+                   const std::vector<uint8_t>& bases, size_t from, size_t len, Rng& rng) {
+    out += name;
+    out += mate;
+    size_t start = out.size();
+    out.resize(start + 2 * len + 4);
+    char* seq = &out[start];
+    for (size_t i = 0; i < len; i++) seq[i] = BASES[bases[from + i]];
+    char* qual = seq + len;
+    std::memcpy(qual, "\n+\n", 3);
+    qual += 3;
+    for (size_t i = 0; i < len; i += 16) {
+        uint64_t x = rng();
+        for (size_t j = i; j < std::min(len, i + 16); j++, x >>= 4) qual[j] = QUALITIES[x & 15];
+    }
+    qual[len] = '\n';
+}
+
+// --------------------------------------------------
+// Generator
+// --------------------------------------------------
+// A later copy of a molecule, due at output pair `pos`
+struct Copy {
+    uint64_t pos, mol;
+    uint32_t copy;
+    bool dup;
+    bool operator>(const Copy& o) const {
+        return pos != o.pos ? pos > o.pos : mol != o.mol ? mol > o.mol : copy > o.copy;
+    }
+};
+
+struct Truth {
+    uint64_t pairs = 0, molecules = 0, duplicates = 0, copies_with_errors = 0;
+    std::map<uint64_t, uint64_t> family_sizes;
+};
+
+void usage() {
+    std::cerr << "Usage: gen_fastq [--out PREFIX] [--pairs N] [--length L] [--dup-rate D] "
+              << "[--families geometric|poisson|zipf] [--error-rate E] [--spread N] "
+              << "[--index | --barcode-in-name] [--umi-length U] [--seed S] [--threads T] [--level 1-9]\n"
+              << "Writes PREFIX_R1.fq.gz, PREFIX_R2.fq.gz (and PREFIX_I1.fq.gz with --index) and "
+              << "PREFIX_truth.txt. N accepts K, M and G (x1000) suffixes.\n";
+}
+
+uint64_t parse_count(const std::string& text) {
+    size_t pos = 0;
+    double value = std::stod(text, &pos);
+    std::string unit = text.substr(pos);
+    double mult = 1;
+    if (unit == "K" || unit == "k") mult = 1e3;
+    else if (unit == "M" || unit == "m") mult = 1e6;
+    else if (unit == "G" || unit == "g" || unit == "B" || unit == "b") mult = 1e9;
+    else if (!unit.empty()) throw std::runtime_error("Bad count: " + text);
+    return static_cast<uint64_t>(value * mult);
+}
+
+int main(int argc, char* argv[]) {
+    Params p;
+    std::string prefix = "sim";
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    int level = 1;  // fast; 6 for the file sizes of sequencers
+
+    static struct option long_options[] = {
+        {"out", required_argument, 0, 'o'},
+        {"pairs", required_argument, 0, 'n'},
+        {"length", required_argument, 0, 'l'},
+        {"dup-rate", required_argument, 0, 'd'},
+        {"families", required_argument, 0, 'f'},
+        {"error-rate", required_argument, 0, 'e'},
+        {"spread", required_argument, 0, 'w'},
+        {"index", no_argument, 0, 'i'},
+        {"barcode-in-name", no_argument, 0, 'c'},
+        {"umi-length", required_argument, 0, 'u'},
+        {"seed", required_argument, 0, 's'},
+        {"threads", required_argument, 0, 't'},
+        {"level", required_argument, 0, 'z'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    try {
+        while ((opt = getopt_long(argc, argv, "o:n:l:d:f:e:w:icu:s:t:z:h", long_options, NULL)) != -1) {
+            switch (opt) {
+                case 'o': prefix = optarg; break;
+                case 'n': p.pairs = parse_count(optarg); break;
+                case 'l': p.length = std::stoul(optarg); break;
+                case 'd': p.dup_rate = std::stod(optarg); break;
+                case 'f': p.families = optarg; break;
+                case 'e': p.error_rate = std::stod(optarg); break;
+                case 'w': p.spread = parse_count(optarg); break;
+                case 'i': p.index = true; break;
+                case 'c': p.barcode_in_name = true; break;
+                case 'u': p.umi_length = std::stoul(optarg); break;
+                case 's': p.seed = std::stoull(optarg); break;
+                case 't': threads = std::stoul(optarg); break;
+                case 'z': level = std::stoi(optarg); break;
+                case 'h': usage(); return 0;
+                default: usage(); return 1;
+            }
+        }
+    } catch (const std::exception&) {
+        std::cerr << "Error: bad value for option " << argv[optind - 1] << "\n";
+        return 1;
+    }
+
+    // Random molecules of 2 x 20 bp or more never share a sequence by
+    // chance (4^40 possible pairs), so the ground truth only has to
+    // compare the copies of each molecule
+    if (p.length < 20) {
+        std::cerr << "Error: --length must be at least 20\n";
+        return 1;
+    }
+    if (p.dup_rate < 0 || p.dup_rate >= 1) {
+        std::cerr << "Error: --dup-rate must be in [0, 1)\n";
+        return 1;
+    }
+    if (p.error_rate < 0 || p.error_rate >= 1) {
+        std::cerr << "Error: --error-rate must be in [0, 1)\n";
+        return 1;
+    }
+    if (p.index && p.barcode_in_name) {
+        std::cerr << "Error: use either --index or --barcode-in-name\n";
+        return 1;
+    }
+    if (level < 1 || level > 9) {
+        std::cerr << "Error: --level must be between 1 and 9\n";
+        return 1;
+    }
+    if (!p.index && !p.barcode_in_name) p.umi_length = 0;
+    if (p.spread < 1) p.spread = 1;
+
+    std::unique_ptr<FamilySizes> family_size;
+    try {
+        family_size.reset(new FamilySizes(p.families, p.dup_rate));
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+
+    Truth truth;
+    try {
+        GzipPool pool(threads, level);
+        size_t r1_file = pool.open(prefix + "_R1.fq.gz");
+        size_t r2_file = pool.open(prefix + "_R2.fq.gz");
+        size_t i1_file = p.index ? pool.open(prefix + "_I1.fq.gz") : 0;
+        const size_t BLOCK = 4 << 20;
+        std::string r1, r2, i1, name;
+        r1.reserve(BLOCK + 4096);
+        r2.reserve(BLOCK + 4096);
+
+        Rng rng(p.seed);
+        std::priority_queue<Copy, std::vector<Copy>, std::greater<Copy>> due;
+        std::vector<uint64_t> offsets;
+        std::unordered_set<uint64_t> signatures;
+        std::vector<uint8_t> bases;
+        uint64_t next_mol = 0;
+
+        for (uint64_t pos = 0; pos < p.pairs; pos++) {
+            uint64_t remaining = p.pairs - pos;
+            Copy c;
+            // A due copy goes first; near the end of the file, copies
+            // are emitted early so that every scheduled copy fits
+            if (!due.empty() && (due.top().pos <= pos || due.size() >= remaining)) {
+                c = due.top();
+                due.pop();
+            } else {
+                c = Copy{pos, next_mol++, 0, false};
+                uint64_t size = std::min<uint64_t>((*family_size)(rng), remaining - due.size());
+                truth.molecules++;
+                truth.family_sizes[size]++;
+                // Copies at random later positions, in copy order
+                uint64_t window = std::min<uint64_t>(p.spread, remaining - 1);
+                offsets.clear();
+                for (uint64_t k = 1; k < size; k++) offsets.push_back(1 + rng() % window);
+                std::sort(offsets.begin(), offsets.end());
+                signatures.clear();
+                signatures.insert(error_signature(p, c.mol, 0));
+                for (uint64_t k = 1; k < size; k++) {
+                    bool dup = !signatures.insert(error_signature(p, c.mol, k)).second;
+                    due.push(Copy{pos + offsets[k - 1], c.mol, uint32_t(k), dup});
+                }
+            }
+
+            truth.pairs++;
+            if (c.copy > 0) {
+                if (c.dup) truth.duplicates++;
+                else truth.copies_with_errors++;
+            }
+
+            molecule_bases(p, c.mol, bases);
+            for_each_error(p, c.mol, c.copy, [&](uint64_t i, unsigned shift) { bases[i] = (bases[i] + shift) & 3; });
+            Rng qual(mix64(p.seed + pos));
+            name = "@GEN:" + std::to_string(c.mol) + ":" + std::to_string(c.copy) + (c.dup ? ":d" : ":u");
+            if (p.barcode_in_name) {
+                name += ':';
+                for (size_t i = 2 * p.length; i < bases.size(); i++) name += BASES[bases[i]];
+            }
+            append_record(r1, name, " 1:N:0\n", bases, 0, p.length, qual);
+            append_record(r2, name, " 2:N:0\n", bases, p.length, p.length, qual);
+            if (p.index) append_record(i1, name, " 1:N:0\n", bases, 2 * p.length, p.umi_length, qual);
+
+            if (r1.size() >= BLOCK) {
+                pool.submit(r1_file, r1);
+                pool.submit(r2_file, r2);
+                if (p.index) pool.submit(i1_file, i1);
+            }
+            if ((pos + 1) % 1000000 == 0)
+                std::cerr << "\rGenerated " << (pos + 1) << " / " << p.pairs << " pairs" << std::flush;
+        }
+        if (!r1.empty()) {
+            pool.submit(r1_file, r1);
+            pool.submit(r2_file, r2);
+            if (p.index) pool.submit(i1_file, i1);
+        }
+        pool.close();
+        if (p.pairs >= 1000000) std::cerr << "\n";
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+
+    std::string truth_file = prefix + "_truth.txt";
+    std::ofstream out(truth_file);
+    out << "pairs\t" << truth.pairs << "\n"
+        << "molecules\t" << truth.molecules << "\n"
+        << "unique_keys\t" << (truth.pairs - truth.duplicates) << "\n"
+        << "duplicates\t" << truth.duplicates << "\n"
+        << "copies_with_errors\t" << truth.copies_with_errors << "\n"
+        << "read_length\t" << p.length << "\n"
+        << "umi_length\t" << p.umi_length << "\n"
+        << "dup_rate\t" << p.dup_rate << "\n"
+        << "error_rate\t" << p.error_rate << "\n"
+        << "families\t" << family_size->describe() << "\n"
+        << "seed\t" << p.seed << "\n";
+    for (const auto& f : truth.family_sizes) out << "family_size\t" << f.first << "\t" << f.second << "\n";
+    out.close();
+    if (!out) {
+        std::cerr << "Error: cannot write " << truth_file << "\n";
+        return 1;
+    }
+
+    std::cerr << "Pairs: " << truth.pairs << ", molecules: " << truth.molecules
+              << ", duplicates: " << truth.duplicates << " (" << (100.0 * truth.duplicates / std::max<uint64_t>(1, truth.pairs))
+              << "%), copies with errors: " << truth.copies_with_errors
+              << ", expected output of exact backends: " << (truth.pairs - truth.duplicates) << " pairs\n";
+    return 0;
+}
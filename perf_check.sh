@@ -0,0 +1,194 @@
+#!/usr/bin/env bash
+
+# perf_check.sh
+
+# End-to-end throughput check of dedup (make perf-check): runs ./dedup
+# with every backend on datasets made by ./gen_fastq, writes reads/s,
+# peak RSS and output checksums to a results file, and compares them with
+# a baseline from an earlier run on the same machine.
+
+# Fails (exit status 1) when
+# - an exact backend writes other reads than the ground truth, or other
+#   reads than the other exact backends;
+# - an allocation-free configuration makes more than PERF_MAX_ALLOCS heap
+#   allocations per read pair after the first chunk (--max-allocs-per-read);
+# - a configuration with --max-memory has a peak RSS above the limit
+#   (the pages of the mmap'd runs of --use-adaptive, which the kernel can
+#   reclaim, are not counted);
+# - a configuration is slower, or uses more memory, than the baseline
+#   beyond the tolerance.
+
+# Settings (environment): PERF_PAIRS (pairs per dataset, default 1M),
+# PERF_REPEAT (runs per configuration, the fastest is kept, default 1),
+# PERF_TOLERANCE (default 0.10), PERF_MAX_ALLOCS (default 0.001: a few
+# allocations when a backend grows, none per read), PERF_DIR (default perf_data),
+# PERF_RESULTS (default perf_results.tsv), PERF_BASELINE (default
+# perf_baseline.tsv). With --save-baseline, the results replace the
+# baseline. Without a baseline, the first results become the baseline.
+
+set -u
+
+PAIRS=${PERF_PAIRS:-1M}
+REPEAT=${PERF_REPEAT:-1}
+TOLERANCE=${PERF_TOLERANCE:-0.10}
+MAX_ALLOCS=${PERF_MAX_ALLOCS:-0.001}
+DIR=${PERF_DIR:-perf_data}
+RESULTS=${PERF_RESULTS:-perf_results.tsv}
+BASELINE=${PERF_BASELINE:-perf_baseline.tsv}
+ROOT=$(pwd)
+DEDUP=$ROOT/dedup
+GEN=$ROOT/gen_fastq
+
+save_baseline=0
+[ "${1:-}" = "--save-baseline" ] && save_baseline=1
+
+# name, exact (1) or approximate (0), allocation-free main loop (1) or
+# not (0), dedup options; --sqlite-shards is the only thread count of dedup
+CONFIGS=(
+    "memory 1 0 --use-memory"
+    "bloom 0 1 --use-bloom"
+    "sqlite 1 1 --use-sqlite"
+    "sqlite-shards2 1 1 --use-sqlite --sqlite-shards 2"
+    "sqlite-shards4 1 1 --use-sqlite --sqlite-shards 4"
+    "sqlite-shards4-bloom 1 0 --use-sqlite --sqlite-shards 4 --sqlite-bloom"
+    "two-pass 1 0 --use-two-pass"
+    "adaptive 1 1 --use-adaptive"
+    "adaptive-spill 1 1 --use-adaptive --max-memory 64M"
+    "extsort 1 0 --use-extsort"
+    "mmap-table 1 1 --use-mmap-table"
+    "quotient 0 1 --use-quotient"
+    "cuckoo 0 1 --use-cuckoo"
+    "elias-fano 1 1 --use-elias-fano"
+    "verified 1 1 --use-verified"
+)
+
+# Value of a number field of the --stats-json report
+json_number() {
+    sed -E "s/.*\"$2\": ([-0-9.e+]+).*/\1/" "$1"
+}
+
+# Bytes in a size with an optional K, M or G suffix, as for --max-memory
+size_bytes() {
+    awk -v s="$1" 'BEGIN { u = substr(s, length(s)); f = u == "K" ? 1024 : u == "M" ? 1048576 : u == "G" ? 1073741824 : 1
+                           printf "%.0f", (s + 0) * f }'
+}
+
+# Truth file value
+truth() {
+    awk -v key="$2" '$1 == key { print $2 }' "$1"
+}
+
+mkdir -p "$DIR" || exit 1
+
+# Datasets: plain, and with an index file; regenerated when the size changes
+for dataset in plain index; do
+    opts=""
+    [ $dataset = index ] && opts="--index"
+    prefix=$DIR/$dataset
+    if [ ! -f ${prefix}_truth.txt ] || [ "$(cat ${prefix}.pairs 2>/dev/null)" != "$PAIRS" ]; then
+        echo "Generating $dataset dataset ($PAIRS pairs)..."
+        "$GEN" --pairs "$PAIRS" --out "$prefix" $opts 2>/dev/null || { echo "gen_fastq failed"; exit 1; }
+        echo "$PAIRS" > ${prefix}.pairs
+    fi
+done
+
+failed=0
+printf "dataset\tconfig\treads_per_s\tpeak_rss_mb\twritten\tchecksum\n" > "$RESULTS"
+printf "%-8s %-22s %12s %10s %10s  %s\n" dataset config reads/s "RSS (MB)" written check
+for dataset in plain index; do
+    prefix=$ROOT/$DIR/$dataset
+    index_opt=""
+    [ $dataset = index ] && index_opt="--index ${prefix}_I1.fq.gz"
+    unique=$(truth ${prefix}_truth.txt unique_keys)
+    exact_sum=""
+    for config in "${CONFIGS[@]}"; do
+        set -- $config
+        name=$1 exact=$2 alloc_free=$3
+        shift 3
+        alloc_opt=""
+        [ $alloc_free = 1 ] && alloc_opt="--max-allocs-per-read $MAX_ALLOCS"
+        work=$DIR/run
+        rm -rf "$work" && mkdir -p "$work"
+        best=0 rss=0 rss_bytes=0 alloc_check=""
+        for ((i = 0; i < REPEAT; i++)); do
+            (cd "$work" && "$DEDUP" --read1 ${prefix}_R1.fq.gz --read2 ${prefix}_R2.fq.gz $index_opt "$@" $alloc_opt \
+                --stats-json stats.json > /dev/null 2> dedup.log)
+            status=$?
+            # Exit status 2: over the --max-allocs-per-read limit
+            if [ $status = 2 ] && [ -n "$alloc_opt" ]; then
+                alloc_check="FAIL: $(json_number $work/stats.json steady_allocs) allocations after the first chunk"
+            elif [ $status != 0 ]; then
+                echo "$dataset $name: dedup failed, see $work/dedup.log"
+                exit 1
+            fi
+            processed=$(json_number $work/stats.json processed)
+            wall=$(json_number $work/stats.json wall_s)
+            rate=$(awk -v n=$processed -v t=$wall 'BEGIN { printf "%.0f", (t > 0 ? n / t : 0) }')
+            [ $rate -gt $best ] && best=$rate
+            peak=$(json_number $work/stats.json peak_rss_bytes)
+            [ $peak -gt $rss_bytes ] && rss_bytes=$peak
+            rss=$(awk -v b=$rss_bytes 'BEGIN { printf "%.1f", b / 1048576 }')
+        done
+        written=$(json_number $work/stats.json written)
+        # Checksum of the sorted pairs: --use-two-pass writes its false
+        # positives back at the end, so only the set of pairs is compared
+        sum=$(paste <(gzip -dc $work/nodup_${dataset}_R1.fq.gz | paste - - - -) \
+                    <(gzip -dc $work/nodup_${dataset}_R2.fq.gz | paste - - - -) | LC_ALL=C sort | cksum | awk '{ print $1 }')
+
+        check=ok
+        if [ $exact = 1 ]; then
+            [ -z "$exact_sum" ] && exact_sum=$sum
+            if [ $written != $unique ]; then
+                check="FAIL: $written pairs written, $unique in the ground truth"
+                failed=1
+            elif [ $sum != $exact_sum ]; then
+                check="FAIL: output differs from the other exact backends"
+                failed=1
+            fi
+        else
+            check="$((unique - written)) false positives"
+        fi
+        if [ -n "$alloc_check" ]; then
+            check=$alloc_check
+            failed=1
+        fi
+        max_memory=$(echo "$*" | sed -nE 's/.*--max-memory ([0-9]+[KMG]?).*/\1/p')
+        if [ -n "$max_memory" ]; then
+            disk_keys=0
+            grep -q '"disk_keys"' $work/stats.json && disk_keys=$(json_number $work/stats.json disk_keys)
+            if [ $rss_bytes -gt $(( $(size_bytes $max_memory) + disk_keys * 16 )) ]; then
+                check="FAIL: peak RSS $rss MB above --max-memory $max_memory"
+                failed=1
+            fi
+        fi
+        printf "%s\t%s\t%s\t%s\t%s\t%s\n" $dataset $name $best $rss $written $sum >> "$RESULTS"
+        printf "%-8s %-22s %12s %10s %10s  %s\n" $dataset $name $best $rss $written "$check"
+    done
+done
+rm -rf "$DIR/run"
+
+if [ $save_baseline = 1 ] || [ ! -f "$BASELINE" ]; then
+    cp "$RESULTS" "$BASELINE"
+    echo "Results saved as the baseline ($BASELINE)"
+else
+    echo "Comparison with $BASELINE (tolerance $TOLERANCE):"
+    awk -F'\t' -v tol=$TOLERANCE '
+        NR == FNR { if (FNR > 1) { rate[$1 "\t" $2] = $3; rss[$1 "\t" $2] = $4; sum[$1 "\t" $2] = $6 } next }
+        FNR > 1 {
+            key = $1 "\t" $2
+            if (!(key in rate)) { printf "  %s %s: not in the baseline\n", $1, $2; next }
+            if ($3 < rate[key] * (1 - tol)) {
+                printf "  %s %s: SLOWER, %d reads/s against %d (%+.1f%%)\n", $1, $2, $3, rate[key], 100 * ($3 / rate[key] - 1)
+                bad = 1
+            }
+            if ($4 > rss[key] * (1 + tol)) {
+                printf "  %s %s: MORE MEMORY, %.1f MB against %.1f MB\n", $1, $2, $4, rss[key]
+                bad = 1
+            }
+            if ($6 != sum[key]) printf "  %s %s: output changed since the baseline\n", $1, $2
+        }
+        END { if (!bad) print "  no regression"; exit bad }
+    ' "$BASELINE" "$RESULTS" || failed=1
+fi
+
+exit $failed
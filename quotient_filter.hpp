@@ -0,0 +1,230 @@
+// quotient_filter.hpp
+
+// Quotient filter (Bender et al., "Don't thrash: how to cache your hash
+// on flash", 2012) with a small saturating counter in every slot. This
+// is the original quotient filter with shifted runs, not the rank/select
+// counting quotient filter of Pandey et al. (2017).
+
+// A p-bit hash is split into a q-bit quotient, the home slot, and an
+// r-bit remainder stored in the slot. Remainders with the same quotient
+// form a sorted run; runs are kept in quotient order and shifted right
+// when they collide, and three metadata bits per slot (occupied,
+// continuation, shifted) let lookups rebuild the quotient of every
+// stored remainder. A lookup only touches the cluster around the home
+// slot, which is usually one or two cache lines. The false positive rate
+// is about load * 2^-r.
+
+// The table has a fixed size: past 90% load it reports full() (keys are
+// still stored, up to the last slot), and the caller is expected to
+// continue in a new filter. Doubling in place would cost a remainder bit,
+// and with it half the false positive rate, per doubling.
+
+#ifndef INCLUDE_QUOTIENT_FILTER_HPP
+#define INCLUDE_QUOTIENT_FILTER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+class QuotientFilter {
+public:
+    // Filter for expected_keys keys with about 2^-remainder_bits false
+    // positives at full load; counts saturate at 2^count_bits - 1
+    QuotientFilter(uint64_t expected_keys, unsigned remainder_bits, unsigned count_bits = 5)
+        : cbits(count_bits) {
+        if (remainder_bits < 1 || count_bits < 1 || remainder_bits + count_bits + 3 > 64)
+            throw std::runtime_error("Bad quotient filter parameters");
+        unsigned q = 6;
+        while (q < 48 && (uint64_t(1) << q) * MAX_LOAD_PERCENT / 100 < expected_keys) q++;
+        hash_bits = q + remainder_bits;
+        if (hash_bits > 64) throw std::runtime_error("Bad quotient filter parameters");
+        init(q, remainder_bits);
+    }
+
+    // Add one occurrence of hash (only the low hash_bits() bits are used);
+    // returns the count before the insert, 0 if the key was new
+    uint64_t insert(uint64_t hash) { return add(hash, 1, true); }
+
+    // The same for a key already stored; a new key is not added (returns 0)
+    uint64_t increment(uint64_t hash) { return add(hash, 1, false); }
+
+    bool contains(uint64_t hash) const {
+        uint64_t fq = quotient(hash), fr = remainder(hash);
+        if (!is_occupied(get(fq))) return false;
+        uint64_t s = find_run_index(fq);
+        do {
+            uint64_t rem = get_remainder(get(s));
+            if (rem == fr) return true;
+            if (rem > fr) return false;
+            s = incr(s);
+        } while (is_continuation(get(s)));
+        return false;
+    }
+
+    bool full() const { return entries >= max_entries; }
+    uint64_t size() const { return entries; }               // distinct keys
+    uint64_t slots() const { return uint64_t(1) << qbits; }
+    unsigned hash_bits_used() const { return hash_bits; }
+    unsigned remainder_bits() const { return rbits; }
+    size_t memory_bytes() const { return table.size() * sizeof(uint64_t); }
+    double load() const { return double(entries) / slots(); }
+    double fpp() const { return load() / double(uint64_t(1) << rbits); }
+
+    // Calls f(hash, count) once for every stored key
+    template <typename F>
+    void for_each(F f) const {
+        if (entries == 0) return;
+        uint64_t start = 0;
+        while (!is_cluster_start(get(start))) start++;
+        uint64_t index = start, quot = start, visited = 0;
+        while (visited < entries) {
+            uint64_t elt = get(index);
+            if (is_cluster_start(elt)) {
+                quot = index;
+            } else if (is_run_start(elt)) {
+                do { quot = incr(quot); } while (!is_occupied(get(quot)));
+            }
+            index = incr(index);
+            if (!is_empty(elt)) {
+                f((quot << rbits) | get_remainder(elt), get_count(elt));
+                visited++;
+            }
+        }
+    }
+
+private:
+    static const unsigned MAX_LOAD_PERCENT = 90;
+
+    unsigned qbits = 0, rbits = 0, cbits, width = 0, hash_bits = 0;
+    uint64_t mask = 0, entries = 0, max_entries = 0;
+    std::vector<uint64_t> table;  // bit-packed slots of `width` bits
+
+    // Slot layout, low to high: occupied, continuation, shifted, count,
+    // remainder
+    static bool is_occupied(uint64_t e) { return e & 1; }
+    static bool is_continuation(uint64_t e) { return e & 2; }
+    static bool is_shifted(uint64_t e) { return e & 4; }
+    static bool is_empty(uint64_t e) { return (e & 7) == 0; }
+    static bool is_cluster_start(uint64_t e) { return is_occupied(e) && !is_continuation(e) && !is_shifted(e); }
+    static bool is_run_start(uint64_t e) { return !is_continuation(e) && (is_occupied(e) || is_shifted(e)); }
+    static uint64_t set_occupied(uint64_t e) { return e | 1; }
+    static uint64_t clr_occupied(uint64_t e) { return e & ~uint64_t(1); }
+    static uint64_t set_continuation(uint64_t e) { return e | 2; }
+    static uint64_t set_shifted(uint64_t e) { return e | 4; }
+    uint64_t get_remainder(uint64_t e) const { return e >> (3 + cbits); }
+    uint64_t get_count(uint64_t e) const { return (e >> 3) & ((uint64_t(1) << cbits) - 1); }
+    uint64_t with_count(uint64_t e, uint64_t c) const {
+        uint64_t cmask = ((uint64_t(1) << cbits) - 1) << 3;
+        return (e & ~cmask) | (c << 3 & cmask);
+    }
+
+    uint64_t quotient(uint64_t hash) const { return (hash >> rbits) & mask; }
+    uint64_t remainder(uint64_t hash) const { return hash & ((uint64_t(1) << rbits) - 1); }
+    uint64_t incr(uint64_t i) const { return (i + 1) & mask; }
+    uint64_t decr(uint64_t i) const { return (i - 1) & mask; }
+
+    void init(unsigned q, unsigned r) {
+        qbits = q;
+        rbits = r;
+        width = r + cbits + 3;
+        mask = (uint64_t(1) << q) - 1;
+        entries = 0;
+        max_entries = (uint64_t(1) << q) * MAX_LOAD_PERCENT / 100;
+        table.assign(((uint64_t(1) << q) * width + 63) / 64 + 1, 0);
+    }
+
+    uint64_t get(uint64_t i) const {
+        uint64_t bit = i * width, word = bit / 64, off = bit % 64;
+        uint64_t e = table[word] >> off;
+        if (off + width > 64) e |= table[word + 1] << (64 - off);
+        return width == 64 ? e : e & ((uint64_t(1) << width) - 1);
+    }
+
+    void set(uint64_t i, uint64_t e) {
+        uint64_t bit = i * width, word = bit / 64, off = bit % 64;
+        uint64_t m = width == 64 ? ~uint64_t(0) : (uint64_t(1) << width) - 1;
+        table[word] = (table[word] & ~(m << off)) | (e << off);
+        if (off + width > 64) {
+            unsigned spill = 64 - off;
+            table[word + 1] = (table[word + 1] & ~(m >> spill)) | (e >> spill);
+        }
+    }
+
+    // Start of the run of quotient fq (fq must be occupied)
+    uint64_t find_run_index(uint64_t fq) const {
+        uint64_t b = fq;
+        while (is_shifted(get(b))) b = decr(b);
+        uint64_t s = b;
+        while (b != fq) {
+            do { s = incr(s); } while (is_continuation(get(s)));
+            do { b = incr(b); } while (!is_occupied(get(b)));
+        }
+        return s;
+    }
+
+    // Put elt at slot s, shifting the following slots right up to the
+    // next empty one; occupied bits stay with their slot
+    void insert_into(uint64_t s, uint64_t elt) {
+        uint64_t curr = elt;
+        bool empty;
+        do {
+            uint64_t prev = get(s);
+            empty = is_empty(prev);
+            if (!empty) {
+                prev = set_shifted(prev);
+                if (is_occupied(prev)) {
+                    curr = set_occupied(curr);
+                    prev = clr_occupied(prev);
+                }
+            }
+            set(s, curr);
+            curr = prev;
+            s = incr(s);
+        } while (!empty);
+    }
+
+    uint64_t add(uint64_t hash, uint64_t count, bool insert_new) {
+        if (entries + 1 >= slots() && insert_new) throw std::runtime_error("Quotient filter full");
+        uint64_t fq = quotient(hash), fr = remainder(hash);
+        uint64_t max_count = (uint64_t(1) << cbits) - 1;
+        uint64_t T_fq = get(fq);
+        uint64_t entry = with_count(fr << (3 + cbits), std::min(count, max_count));
+
+        if (!is_occupied(T_fq) && !insert_new) return 0;
+        if (is_empty(T_fq)) {
+            set(fq, set_occupied(entry));
+            entries++;
+            return 0;
+        }
+        if (!is_occupied(T_fq)) set(fq, set_occupied(T_fq));
+
+        uint64_t start = find_run_index(fq);
+        uint64_t s = start;
+        if (is_occupied(T_fq)) {
+            // Find the position of fr in the sorted run
+            do {
+                uint64_t e = get(s);
+                uint64_t rem = get_remainder(e);
+                if (rem == fr) {
+                    uint64_t old = get_count(e);
+                    set(s, with_count(e, std::min(old + count, max_count)));
+                    return old;
+                }
+                if (rem > fr) break;
+                s = incr(s);
+            } while (is_continuation(get(s)));
+            if (!insert_new) return 0;
+
+            if (s == start) set(start, set_continuation(get(start)));  // old head moves on
+            else entry = set_continuation(entry);
+        }
+        if (s != fq) entry = set_shifted(entry);
+        insert_into(s, entry);
+        entries++;
+        return 0;
+    }
+};
+
+#endif
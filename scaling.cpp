@@ -0,0 +1,310 @@
+// scaling.cpp
+
+// Backend scaling study: inserts synthetic fingerprints into each
+// backend at log-spaced sizes (1M, 3M, 10M, ... up to --max-keys) and
+// writes one CSV row per backend and size, with the insert and lookup
+// rates, the memory and disk bytes per key and the measured false
+// positive rate, to choose a backend from data.
+
+// Keys go through the same lookup_chunk() calls as in dedup, in chunks
+// of 4096. Each measurement runs in its own process, so its peak RSS is
+// its own and a backend that runs out of memory only ends its series.
+
+// Usage: dedup_scaling [--max-keys 1G] [--backends memory,bloom,...]
+//                      [--out scaling.csv] (dedup_scaling --help)
+
+
+
+#define DEDUP_NO_MAIN
+#include "dedup.cpp"
+
+#include <sys/wait.h>
+
+const char* const ALL_BACKENDS[] = {"memory", "bloom", "sqlite", "adaptive", "mmap-table",
+                                    "quotient", "cuckoo", "elias-fano", "verified"};
+
+struct ScalingOptions {
+    uint64_t min_keys = 1000000, max_keys = 1000000000, lookups = 1000000;
+    std::vector<std::string> backends;
+    std::string out = "scaling.csv", tmp_dir = ".";
+    size_t sqlite_shards = 1;
+    double time_limit = 600;  // seconds; larger sizes are skipped
+    size_t max_memory = 0;    // 0: cgroup limit or physical RAM
+};
+
+struct Measurement {
+    double insert_s = 0, lookup_s = 0;
+    uint64_t lookups = 0, false_positives = 0, false_negatives = 0;
+    uint64_t rss_bytes = 0, disk_bytes = 0;
+};
+
+// splitmix64 finalizer
+inline uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Key i of a series: distinct for every i (in practice: 128 random bits)
+inline Fingerprint scaling_key(uint64_t i) {
+    return Fingerprint{mix64(2 * i + 1), mix64(2 * i + 2)};
+}
+
+size_t current_rss() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    if (!(statm >> pages >> resident)) return 0;
+    return resident * sysconf(_SC_PAGE_SIZE);
+}
+
+// Bytes of the backend's files in the temporary directory
+template <typename Store>
+uint64_t disk_bytes(Store&, const std::string& prefix) {
+    std::filesystem::path p(prefix);
+    std::string name = p.filename().string();
+    uint64_t bytes = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(p.parent_path())) {
+        if (entry.is_regular_file() && entry.path().filename().string().rfind(name, 0) == 0)
+            bytes += entry.file_size();
+    }
+    return bytes;
+}
+
+// Their files are unlinked as soon as they are opened
+uint64_t disk_bytes(VerifiedStore& store, const std::string&) { return store.disk_bytes(); }
+uint64_t disk_bytes(MmapHashStore& store, const std::string&) { return store.file_bytes(); }
+
+template <typename Store>
+void measure_store(Store& store, uint64_t n, const ScalingOptions& opt, const std::string& prefix, Measurement& m) {
+    Chunk c;
+    LatencyRecorder* latency = new_latency_recorder("scaling");
+
+    // Inserts: every key is new, so a duplicate answer is a false positive
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t first = 0; first < n; first += Chunk::CAPACITY) {
+        c.size = std::min<uint64_t>(Chunk::CAPACITY, n - first);
+        for (size_t i = 0; i < c.size; i++) {
+            c.keys[i] = scaling_key(first + i);
+            c.material[i].assign(reinterpret_cast<const char*>(&c.keys[i]), sizeof(Fingerprint));
+            c.unique[i] = 1;
+        }
+        lookup_chunk(store, c, *latency);
+        for (size_t i = 0; i < c.size; i++) m.false_positives += !c.unique[i];
+    }
+    m.insert_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Lookups of stored keys in random order, as for duplicate reads
+    m.lookups = std::min(n, opt.lookups);
+    uint64_t state = n;
+    start = std::chrono::steady_clock::now();
+    for (uint64_t done = 0; done < m.lookups; done += c.size) {
+        c.size = std::min<uint64_t>(Chunk::CAPACITY, m.lookups - done);
+        for (size_t i = 0; i < c.size; i++) {
+            c.keys[i] = scaling_key(mix64(state += 0x9e3779b97f4a7c15ULL) % n);
+            c.material[i].assign(reinterpret_cast<const char*>(&c.keys[i]), sizeof(Fingerprint));
+            c.unique[i] = 1;
+        }
+        lookup_chunk(store, c, *latency);
+        for (size_t i = 0; i < c.size; i++) m.false_negatives += c.unique[i];
+    }
+    m.lookup_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    m.disk_bytes = disk_bytes(store, prefix);
+}
+
+// Sizes and parameters as in dedup's main() for a run of n read pairs
+void measure(const std::string& backend, uint64_t n, const ScalingOptions& opt, Measurement& m) {
+    std::string prefix = opt.tmp_dir + "/dedup_scaling." + std::to_string(getpid());
+    size_t rss_before = current_rss();
+    if (backend == "memory") {
+        MemoryStore store;
+        measure_store(store, n, opt, prefix, m);
+    } else if (backend == "bloom") {
+        BloomStore store(n, 0.001, false);
+        measure_store(store, n, opt, prefix, m);
+    } else if (backend == "sqlite") {
+        ShardedSQLiteStore store(opt.sqlite_shards, prefix, 0);
+        measure_store(store, n, opt, prefix, m);
+    } else if (backend == "adaptive") {
+        AdaptiveStore store(backend_memory_budget(opt.max_memory), prefix);
+        measure_store(store, n, opt, prefix, m);
+    } else if (backend == "mmap-table") {
+        MmapHashStore store(prefix + ".table", n);
+        measure_store(store, n, opt, prefix, m);
+    } else if (backend == "quotient") {
+        QuotientStore store(n, 10);
+        measure_store(store, n, opt, prefix, m);
+    } else if (backend == "cuckoo") {
+        CuckooStore store(n);
+        measure_store(store, n, opt, prefix, m);
+    } else if (backend == "elias-fano") {
+        EliasFanoStore store;
+        measure_store(store, n, opt, prefix, m);
+    } else if (backend == "verified") {
+        VerifiedStore store(prefix, n);
+        measure_store(store, n, opt, prefix, m);
+    } else {
+        throw std::runtime_error("Unknown backend: " + backend);
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    size_t peak = size_t(usage.ru_maxrss) * 1024;  // ru_maxrss is in KB on Linux
+    m.rss_bytes = peak > rss_before ? peak - rss_before : 0;
+}
+
+// Runs measure() in a child process; false if it failed (e.g. was killed
+// for lack of memory)
+bool measure_in_child(const std::string& backend, uint64_t n, const ScalingOptions& opt, Measurement& m) {
+    int fd[2];
+    if (pipe(fd) != 0) throw std::runtime_error("pipe failed");
+    pid_t pid = fork();
+    if (pid < 0) throw std::runtime_error("fork failed");
+    if (pid == 0) {
+        close(fd[0]);
+        int status = 0;
+        try {
+            measure(backend, n, opt, m);
+            if (write(fd[1], &m, sizeof(m)) != sizeof(m)) status = 1;
+        } catch (const std::exception& e) {
+            std::cerr << "\n" << backend << ", " << n << " keys: " << e.what() << "\n";
+            status = 1;
+        }
+        _exit(status);
+    }
+    close(fd[1]);
+    ssize_t got = read(fd[0], &m, sizeof(m));
+    close(fd[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return got == ssize_t(sizeof(m)) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void scaling_usage() {
+    std::cerr << "Usage: dedup_scaling [--min-keys N] [--max-keys N] [--backends a,b,...] [--lookups N] "
+              << "[--out FILE] [--tmp-dir DIR] [--sqlite-shards N] [--time-limit S] [--max-memory SIZE]\n"
+              << "Backends: memory bloom sqlite adaptive mmap-table quotient cuckoo elias-fano verified (default: all)\n";
+}
+
+uint64_t parse_keys(const std::string& text) {
+    size_t pos = 0;
+    double value = std::stod(text, &pos);
+    std::string unit = text.substr(pos);
+    double mult = 1;
+    if (unit == "K" || unit == "k") mult = 1e3;
+    else if (unit == "M" || unit == "m") mult = 1e6;
+    else if (unit == "G" || unit == "g" || unit == "B" || unit == "b") mult = 1e9;
+    else if (!unit.empty()) throw std::runtime_error("Bad count: " + text);
+    return static_cast<uint64_t>(value * mult);
+}
+
+int main(int argc, char* argv[]) {
+    ScalingOptions opt;
+    static struct option long_options[] = {
+        {"min-keys", required_argument, 0, 'n'},
+        {"max-keys", required_argument, 0, 'N'},
+        {"backends", required_argument, 0, 'b'},
+        {"lookups", required_argument, 0, 'l'},
+        {"out", required_argument, 0, 'o'},
+        {"tmp-dir", required_argument, 0, 'T'},
+        {"sqlite-shards", required_argument, 0, 'S'},
+        {"time-limit", required_argument, 0, 't'},
+        {"max-memory", required_argument, 0, 'M'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    int c;
+    try {
+        while ((c = getopt_long(argc, argv, "n:N:b:l:o:T:S:t:M:h", long_options, NULL)) != -1) {
+            switch (c) {
+                case 'n': opt.min_keys = parse_keys(optarg); break;
+                case 'N': opt.max_keys = parse_keys(optarg); break;
+                case 'b': {
+                    std::stringstream list(optarg);
+                    std::string name;
+                    while (std::getline(list, name, ',')) opt.backends.push_back(name);
+                    break;
+                }
+                case 'l': opt.lookups = parse_keys(optarg); break;
+                case 'o': opt.out = optarg; break;
+                case 'T': opt.tmp_dir = optarg; break;
+                case 'S': opt.sqlite_shards = std::stoul(optarg); break;
+                case 't': opt.time_limit = std::stod(optarg); break;
+                case 'M': opt.max_memory = parse_size(optarg); break;
+                case 'h': scaling_usage(); return 0;
+                default: scaling_usage(); return 1;
+            }
+        }
+    } catch (const std::exception&) {
+        std::cerr << "Error: bad value for option " << argv[optind - 1] << "\n";
+        return 1;
+    }
+    if (opt.backends.empty()) opt.backends.assign(std::begin(ALL_BACKENDS), std::end(ALL_BACKENDS));
+    for (const std::string& b : opt.backends) {
+        if (std::find(std::begin(ALL_BACKENDS), std::end(ALL_BACKENDS), b) == std::end(ALL_BACKENDS)) {
+            std::cerr << "Error: unknown backend " << b << "\n";
+            scaling_usage();
+            return 1;
+        }
+    }
+    if (opt.min_keys < 1 || opt.max_keys < opt.min_keys || opt.sqlite_shards < 1) {
+        std::cerr << "Error: need 1 <= --min-keys <= --max-keys and --sqlite-shards >= 1\n";
+        return 1;
+    }
+    size_t memory_limit = opt.max_memory ? opt.max_memory : default_memory_limit();
+
+    // 1, 3, 10, 30, ... x min_keys
+    std::vector<uint64_t> sizes;
+    for (uint64_t decade = opt.min_keys; decade <= opt.max_keys; decade *= 10) {
+        sizes.push_back(decade);
+        if (3 * decade <= opt.max_keys) sizes.push_back(3 * decade);
+    }
+
+    std::ofstream csv(opt.out);
+    if (!csv) {
+        std::cerr << "Error: cannot create " << opt.out << "\n";
+        return 1;
+    }
+    csv << "backend,keys,insert_s,inserts_per_s,lookups_per_s,bytes_per_key,disk_bytes_per_key,"
+        << "false_positives,fpp,false_negatives\n";
+    std::cout << std::left << std::setw(12) << "backend" << std::right << std::setw(12) << "keys"
+              << std::setw(12) << "inserts/s" << std::setw(12) << "lookups/s" << std::setw(10) << "B/key"
+              << std::setw(12) << "disk B/key" << std::setw(12) << "fpp" << "\n";
+
+    for (const std::string& backend : opt.backends) {
+        double last_bytes_per_key = 0;
+        for (uint64_t n : sizes) {
+            // Sizes that would not fit in memory are not tried
+            if (last_bytes_per_key * n > memory_limit) {
+                std::cerr << backend << ": stopping before " << n << " keys (~"
+                          << uint64_t(last_bytes_per_key * n) / (1 << 20) << " MB needed, "
+                          << (memory_limit >> 20) << " MB available)\n";
+                break;
+            }
+            Measurement m;
+            if (!measure_in_child(backend, n, opt, m)) {
+                std::cerr << backend << ": failed at " << n << " keys\n";
+                break;
+            }
+            double bytes_per_key = double(m.rss_bytes) / n;
+            double fpp = double(m.false_positives) / n;
+            csv << backend << "," << n << "," << m.insert_s << "," << (n / m.insert_s) << ","
+                << (m.lookups / m.lookup_s) << "," << bytes_per_key << "," << (double(m.disk_bytes) / n) << ","
+                << m.false_positives << "," << fpp << "," << m.false_negatives << "\n";
+            csv.flush();
+            std::cout << std::left << std::setw(12) << backend << std::right << std::setw(12) << n
+                      << std::fixed << std::setprecision(0)
+                      << std::setw(12) << (n / m.insert_s) << std::setw(12) << (m.lookups / m.lookup_s)
+                      << std::setprecision(1) << std::setw(10) << bytes_per_key
+                      << std::setw(12) << (double(m.disk_bytes) / n)
+                      << std::scientific << std::setprecision(2) << std::setw(12) << fpp
+                      << std::defaultfloat << std::endl;
+            if (m.false_negatives) std::cerr << backend << ": " << m.false_negatives << " stored keys not found\n";
+            last_bytes_per_key = bytes_per_key;
+            if (m.insert_s + m.lookup_s > opt.time_limit) {
+                std::cerr << backend << ": stopping after " << n << " keys (over the time limit of "
+                          << opt.time_limit << " s)\n";
+                break;
+            }
+        }
+    }
+    return 0;
+}